@@ -5,7 +5,6 @@
 #include <stdio.h>
 
 #define APP_NAME "app"
-#define BUILD_DIR "build"
 
 #define CC_TAG "[" CF_YELLOW "CC" CF_RESET "] "
 #define LD_TAG "[" CF_CYAN "LD" CF_RESET "] "
@@ -13,6 +12,14 @@
 
 bool was_rebuilt = false;
 
+/* Each mode builds into build/<mode>, so `./cforge.h release debug` can build both at once */
+static char* build_dir(void) {
+    static char dir[64];
+    const char* mode = CF_ENV(mode);
+    snprintf(dir, sizeof(dir), "build/%s", (mode != NULL) ? mode : "default");
+    return dir;
+}
+
 #if CF_VERSION_BELOW(1, 0, 2)
     #error "CForge too old!"
 #endif
@@ -41,7 +48,7 @@ CF_TARGET(debug, CF_WITH_CONFIG(debug), CF_DEPENDS(build), CF_HELP_STRING("Build
 
 CF_TARGET(run, CF_DEPENDS(debug), CF_HELP_STRING("Run mdprev")) {
     printf(RN_TAG "Running %s...\n", APP_NAME);
-    CF_RUN("./%s/%s", BUILD_DIR, APP_NAME);
+    CF_RUN("./build/debug/%s", APP_NAME);
 }
 
 CF_TARGET(build, CF_DEPENDS(link), CF_HIDDEN) {
@@ -52,32 +59,38 @@ CF_TARGET(build, CF_DEPENDS(link), CF_HIDDEN) {
 }
 
 CF_TARGET(link, CF_DEPENDS(compile), CF_HIDDEN) {
-    if CF_FILE_NOT_UTD(APP_NAME) {
+    char app[128];
+    snprintf(app, sizeof(app), "%s/%s", build_dir(), APP_NAME);
+    if CF_FILE_NOT_UTD(app) {
         was_rebuilt = true;
         CF_BANNER(LD_TAG "Linking...");
-        char* object_files = CF_JOIN_GLOB(CF_GLOB(BUILD_DIR "/*.o"), " ");
+        char pattern[128];
+        snprintf(pattern, sizeof(pattern), "%s/*.o", build_dir());
+        char* object_files = CF_JOIN_GLOB(CF_GLOB(pattern), " ");
         printf(LD_TAG "  %s\n", object_files);
-        CF_RUN("cc %s -o %s/%s", object_files, BUILD_DIR, APP_NAME);
-        CF_FILE_MARK_UTD(APP_NAME);
+        CF_RUN("cc %s -o %s", object_files, app);
+        CF_FILE_MARK_UTD(app);
     }
 }
 
 CF_TARGET(compile, CF_HIDDEN) {
-    CF_MKDIR(BUILD_DIR);
+    CF_MKDIR(build_dir());
     for CF_GLOBS_EACH("src/*.c", file) {
-        char* output = CF_MAP(file, CF_MAP_EXT("o"), CF_MAP_PARENT(BUILD_DIR));
+        char* output = CF_MAP(file, CF_MAP_EXT("o"), CF_MAP_PARENT(build_dir()));
+        char* depfile = CF_MAP(file, CF_MAP_EXT("d"), CF_MAP_PARENT(build_dir()));
         if (CF_FILE_NOT_UTD(file) || CF_FILE_NOT_UTD(output)) {
             was_rebuilt = true;
             CF_BANNER(CC_TAG "Compiling...");
             printf(CC_TAG "  %s\n", file);
-            CF_RUNP("cc %s %s -c %s -o %s",
+            cf_job_t cc = CF_RUNP("cc %s %s -MD -MF %s -c %s -o %s",
                 CF_ENV(cflags),
                 CF_ENV(includes),
+                depfile,
                 file,
                 output
             );
-            CF_FILE_MARK_UTDP(file);
-            CF_FILE_MARK_UTDP(output);
+            CF_FILE_MARK_DEPS_AFTER(cc, file, depfile);
+            CF_FILE_MARK_UTDP_AFTER(cc, output);
         }
     }
 }
@@ -40,9 +40,12 @@ exit 0
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #if defined(__linux__) || defined(linux)
 #include <fcntl.h>
+#include <sched.h>
+#include <sys/ioctl.h>
 
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
@@ -61,8 +64,30 @@ exit 0
 #endif
 
 /* TODO: Port this to Windows someday */
+#include <fcntl.h>
 #include <ftw.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && !defined(CF_DISABLE_SIMD_HASH)
+#define CF_WH_X86 1
+#include <immintrin.h>
+#endif
 
 /* TODO: Add other threading implementations (pthreads, WinAPI) */
 #ifdef __STDC_NO_THREADS__
@@ -78,7 +103,7 @@ exit 0
 #define CF_MAX_TARGETS 64
 #define CF_MAX_CONFIGS 64
 #define CF_MAX_GLOBS 64
-#define CF_MAX_THRDS 16
+#define CF_INIT_THRDS 16
 #define CF_MAX_JOBS 64
 #define CF_MAX_ENVS 256
 #define CF_MAX_JOIN_STRINGS 256
@@ -87,15 +112,44 @@ exit 0
 #define CF_MAX_MAP_ATTRS 8
 #define CF_MAX_MAPS 64
 #define CF_MAX_DEFERRED_UTD 512
+#define CF_MAX_UTD_BATCHES 64
+#define CF_MIN_UTD_BATCH_CHUNK 16
+#define CF_MAX_GROUPS 64
 #define CF_INIT_PENDING_ENTRIES 64
 #define CF_INIT_PENDING_STRING_SZ (4 * 1024)
+#define CF_INIT_DB_INDEX_SZ 128
+/* Fingerprints kept per path, e.g. one per config */
+#define CF_DB_MAX_VARIANTS 4
 
+#define CF_DB_PATH ".cforge.db"
 #define CF_MAGIC_HEADER_VALUE 0xDBCF
-#define CF_DB_CVERSION 0x5
+#define CF_DB_CVERSION 0xA
+#define CF_DB_RECORD_MAGIC 0x4A524543
+#define CF_DB_MIN_COMPACT_SZ (64 * 1024)
+#define CF_DB_NO_REF SIZE_MAX
+/* Variant caching the fingerprint of a prerequisite, whatever the environment */
+#define CF_DB_PREREQ_ENV 0x7072657265717300ull
+#define CF_RACY_WINDOW_NS (2ull * 1000000000ull)
+#define CF_HASH_READ_SZ (64 * 1024)
+#define CF_THROTTLE_POLL_NS (100l * 1000l * 1000l)
+/* Time between SIGTERM and SIGKILL when a command is stopped */
+#define CF_KILL_GRACE_MS 2000
+#define CF_SIGNATURE_SEED 0xC3A5C85C97CB3127ull
+
+#define CF_CACHE_DIR ".cforge-cache"
+/* Least recently used blobs are evicted past this size */
+#define CF_CACHE_MAX_SZ (1024ull * 1024ull * 1024ull)
+#define CF_CACHE_SEED 0x9E3779B97F4A7C15ull
+#define CF_MAX_REMOTE_CONNS 64
+/* Actions looked up and objects uploaded per pipelined exchange */
+#define CF_REMOTE_BATCH 256
+#define CF_REMOTE_TIMEOUT_S 10
+#define CF_HTTP_OUT_SZ (4 * 1024)
 
 #define CF_MAX_NAME_LENGTH 127
 #define CF_MAX_OUTSTR_LENGTH 511
 #define CF_MAX_COMMAND_LENGTH (1 * 1024)
+#define CF_MAX_MAKEFLAGS_LENGTH (4 * 1024)
 #define CF_MAX_JOIN_STRING_LEN 8192
 
 #define CF_ERR_LOG(...) fprintf(stderr, __VA_ARGS__)
@@ -111,10 +165,10 @@ exit 0
 #define CF_DB_FAIL_EC 7
 #define CF_OS_FAIL_EC 8
 #define CF_IMPOSSIBLE_EC 9
+#define CF_INVALID_ARG_EC 10
 
 /* TODO: Port this environment variable system to Windows */
 extern char** environ;
-static uint64_t denv_hash = 0;
 static uint64_t cenv_hash = 0;
 
 typedef void (*cf_target_fn)(void);
@@ -148,28 +202,137 @@ typedef struct {
 typedef enum {
     UNVISITED = 0,
     VISITING,
-    DONE
+    PLANNED,
+    RUNNING,
+    DONE,
+    /* With -k: a job failed, or a dependency did and the target was skipped */
+    FAILED
 } cf_dfs_node_status_t;
 
 typedef struct {
+    const char* name;
+    cf_config_fn fn;
+} cf_config_decl_t;
+
+typedef struct cf_job_node_t cf_job_node_t;
+
+/* Declared inputs and outputs of a cached command, see cf_cached_runner() */
+typedef struct {
+    char** inputs;
+    size_t num_inputs;
+    char** outputs;
+    size_t num_outputs;
+    uint64_t env_hash;
+    /* Set by the cache lookup; unkeyed if an input could not be hashed */
+    uint64_t key[2];
+    bool keyed;
+    /* Remote lookup of a queued job, done in a batch by cf_cache_prefetch() */
+    bool prefetching;
+    bool prefetched;
+} cf_action_t;
+
+/*
+ * Remote action cache backend. Objects are named "ac/<hex>" for records and
+ * "cas/<hex>" for blobs. Each call handles a whole batch, so a backend can
+ * pipeline it. Returning false means the backend failed and is disabled.
+ */
+typedef struct {
+    /* Downloads each object to its path and sets found[i], missing objects aren't errors */
+    bool (*fetch)(void* ctx, const char* const* names, const char* const* paths, bool* found, size_t count);
+    /* Uploads each object from its path and sets stored[i] once the remote accepted it */
+    bool (*push)(void* ctx, const char* const* names, const char* const* paths, bool* stored, size_t count);
+    void (*close)(void* ctx);
+} cf_cache_backend_t;
+
+/* Handle to a CF_RUNP job, valid until the target that queued it is done */
+typedef cf_job_node_t* cf_job_t;
+
+typedef enum {
+    MARK_UTD,
+    MARK_DEPFILE,
+    MARK_SCAN,
+    MARK_COMMAND
+} cf_mark_kind_t;
+
+/* CF_FILE_MARK_UTDP(...), CF_FILE_MARK_DEPS(...), CF_FILE_MARK_SCAN(...) or CF_RUN_TRACKED(...) waiting for the target's jobs */
+typedef struct {
+    cf_mark_kind_t kind;
+    char* path;
+    /* Depfile or -I flags naming the prerequisites of path, NULL for a plain mark */
+    char* arg;
+    /* Outputs of a tracked command and the hash of its command line */
+    cf_action_t* action;
+    uint64_t signature;
+    /* Jobs the target had queued when marking, all of them must succeed */
+    size_t queued;
+} cf_deferred_mark_t;
+
+typedef struct cf_target_decl_t {
     const char* name;
     cf_target_fn fn;
     cf_attr_t* attribs;
     size_t attribs_size;
     cf_dfs_node_status_t node_status;
+    /* Effective config, resolved when the target is planned */
+    cf_config_decl_t* config;
+    /* Registered target this one instantiates for another config, or NULL */
+    struct cf_target_decl_t* base;
+    /* Instances the DEPENDENCY attributes resolved to when planned */
+    struct cf_target_decl_t** deps;
+    size_t num_deps;
+    /* Group of command-line roots it was planned for, see cf_root_joins_phase() */
+    size_t phase;
+    /* The running body plus unfinished jobs, guarded by global_workq->lock */
+    size_t pending;
+    uint64_t env_hash;
+    cf_deferred_mark_t* deferred_utd;
+    size_t num_deferred_utd;
+    /* Job nodes queued by the body, freed once the target is done */
+    cf_job_node_t* jobs;
+    size_t num_jobs;
+    /* env_hash is final, marks of its jobs are committed as they are reaped */
+    bool body_done;
+    /* With -k: one of its commands failed, guarded by global_workq->lock */
+    bool failed;
 } cf_target_decl_t;
 
-typedef struct {
-    const char* name;
-    cf_config_fn fn;
-} cf_config_decl_t;
-
 typedef struct {
     const char* envname;
     char* value;
     bool was_set;
 } cf_env_restore_t;
 
+/* A command that failed with -k, listed once the build is over */
+typedef struct {
+    const char* target;
+    char* command;
+} cf_failure_t;
+
+typedef enum {
+    /* Set by a config, hashed with the value it ends up with */
+    ENV_DEP_CONFIG,
+    /* Read through CF_ENV(...), remembered in the DB for the next run */
+    ENV_DEP_READ,
+    /* Set by the body itself, so its value comes from the build script */
+    ENV_DEP_LOCAL
+} cf_env_dep_kind_t;
+
+typedef struct {
+    char* name;
+    uint64_t term;
+    cf_env_dep_kind_t kind;
+} cf_env_dep_t;
+
+/*
+ * Copy of the environment handed to parallel jobs. Target bodies keep
+ * changing the process environment while earlier jobs are still queued, so
+ * workers never read environ. Refcounted under global_workq->lock.
+ */
+typedef struct {
+    size_t refs;
+    char** envp;
+} cf_env_block_t;
+
 typedef struct {
     size_t c;
     char** p;
@@ -181,6 +344,8 @@ typedef struct {
     uint16_t version;
     uint32_t reserved;
     size_t entry_cnt;
+    /* Prerequisite path hashes between the entries and the strings */
+    size_t deps_cnt;
     size_t string_sz;
 } cf_db_hdr_t __attribute__((aligned(8)));
 
@@ -191,9 +356,33 @@ typedef struct {
     uint64_t mtime_sec;
     uint64_t mtime_nsec;
     uint64_t size;
+    /* Wall-clock time the fingerprint was taken, for racy mtime checks */
+    uint64_t mark_sec;
+    uint64_t mark_nsec;
     size_t path_offset;
+    /* Prerequisites from a depfile and a hash over their fingerprints when marked */
+    size_t deps_offset;
+    size_t deps_cnt;
+    uint64_t deps_hash;
+    /* Direct includes found by the scanner follow the prerequisites */
+    size_t scan_cnt;
+    uint64_t scan_key;
 } cf_db_entry_t __attribute__((aligned(8)));
 
+/*
+ * Journal record appended after the string slab. The path (without NUL)
+ * follows the record, padded to 8 bytes, and then the prerequisite path
+ * hashes and scanned includes of the entry.
+ */
+typedef struct {
+    uint32_t magic;
+    uint16_t path_len;
+    uint16_t reserved;
+    /* XXH64 over entry and path, seeded with path_len */
+    uint64_t checksum;
+    cf_db_entry_t entry;
+} cf_db_record_t __attribute__((aligned(8)));
+
 /* Technically never used */
 typedef struct {
     /* Maximum path on Linux is 4KiB by default */
@@ -207,14 +396,40 @@ typedef struct {
     cf_db_lstring_t* strings;
     cf_db_entry_t* pending_entries;
     cf_db_lstring_t* pending_strings;
+    /* Deps offsets below header->deps_cnt address deps, the rest pending_deps */
+    uint64_t* deps;
+    uint64_t* pending_deps;
+    size_t pdeps_cnt;
+    size_t pdeps_max;
     /* max index */
     size_t pentries_max;
     size_t pentries_idx;
     size_t pstrings_sz;
     size_t pstrings_off;
+    /* Private mapping of the DB file, entries and strings point into it */
+    void* map;
+    size_t map_sz;
+    /* Bytes of valid journal records following the string slab */
+    size_t journal_sz;
+    bool journal_torn;
+    /* Refs updated during this run, appended as records on save */
+    size_t* dirty;
+    size_t dirty_cnt;
+    size_t dirty_max;
+    uint8_t* dirty_bits;
+    size_t dirty_bits_sz;
+    /* Open-addressing index keyed on path_hash, slots hold entry ref + 1 */
+    size_t* index;
+    size_t index_cap;
+    size_t index_cnt;
+    /* Guards the index and entries once UTD checks run on workers */
+    mtx_t lock;
 } cf_db_mem_t;
 
 static cf_db_mem_t* global_db = NULL;
+static once_flag global_db_once = ONCE_FLAG_INIT;
+/* Serializes the final save of global_db with the one of a second signal */
+static mtx_t cf_db_save_lock;
 
 typedef enum {
     REGISTER_PHASE = 0,
@@ -254,19 +469,74 @@ typedef struct {
     char* buf;
 } cf_split_t;
 
+typedef void (*cf_thrd_fn)(void* arg);
+
+/* A job either runs a shell command or calls fn(arg) on the worker */
 typedef struct {
     char* command;
+    cf_thrd_fn fn;
+    void* arg;
+    /* Owner, environment and handle of a command job */
+    cf_target_decl_t* target;
+    cf_env_block_t* env;
+    cf_job_node_t* node;
+    cf_action_t* action;
 } cf_thrd_job;
 
+/*
+ * A job that runs after other jobs is held here, outside the queue, until
+ * the last of them finishes and moves it to the ready list. Guarded by
+ * global_workq->lock.
+ */
+struct cf_job_node_t {
+    cf_thrd_job job;
+    size_t waiting;
+    bool done;
+    /* With -k: the command failed, or one it waited for did and it was dropped */
+    bool failed;
+    cf_job_node_t** dependents;
+    size_t num_dependents;
+    size_t dependents_cap;
+    cf_job_node_t* next_ready;
+    cf_job_node_t* next_owned;
+    /* Position among the jobs of its target */
+    size_t seq;
+    /* Marks made for this job alone, committed by commit_marks once it is reaped, see cf_db_attach_mark() */
+    cf_deferred_mark_t* marks;
+    size_t num_marks;
+    size_t marks_cap;
+    void (*commit_marks)(cf_deferred_mark_t* marks, size_t count, uint64_t env_hash);
+};
+
+/* Set of CF_RUNP jobs that can be waited for, freed with the target body */
+typedef struct {
+    cf_job_t* jobs;
+    size_t count;
+    size_t cap;
+    /* Jobs before this one are known to be done */
+    size_t first_pending;
+} cf_group_t;
+
 typedef struct {
     cf_thrd_job jobs[CF_MAX_JOBS];
-    uint16_t active_jobs;
+    /* Released jobs, run before the queue to keep dependency chains moving */
+    cf_job_node_t* ready_head;
+    cf_job_node_t* ready_tail;
+    size_t active_jobs;
     int32_t front;
     int32_t back;
     mtx_t lock;
     cnd_t free_slot;
     cnd_t new_job;
     cnd_t no_job;
+    cnd_t target_done;
+    cnd_t prefetched;
+    bool shutdown;
+    /* Set once a command failed or SIGINT/SIGTERM arrived, later commands are dropped */
+    bool failed;
+    int32_t signal;
+    /* Jobs a worker is executing right now */
+    size_t running_jobs;
 } cf_work_queue;
 
 static cf_work_queue* global_workq = NULL;
@@ -280,12 +550,33 @@ static size_t cf_num_configs = 0;
 static glob_t cf_globs[CF_MAX_GLOBS] = { 0 };
 static size_t cf_num_globs = 0;
 
-static thrd_t cf_thrd_pool[CF_MAX_THRDS] = { 0 };
+static thrd_t* cf_thrd_pool = NULL;
+static size_t cf_thrd_pool_cap = 0;
 static size_t cf_num_thrds = 0;
 
+/* Maximum concurrently running jobs, set from -j, CF_JOBS or the CPU count */
+static size_t cf_max_jobs = 1;
+
+/* Admission limits for parallel commands from -l and --min-free-mem, 0 disables */
+static double cf_max_load = 0.0;
+static uint64_t cf_min_free_mem = 0;
+
+/* -k: failed commands only stop what depends on them, guarded by global_workq->lock */
+static bool cf_keep_going = false;
+static cf_failure_t* cf_failures = NULL;
+static size_t cf_num_failures = 0;
+static size_t cf_failures_cap = 0;
+
 static cf_env_restore_t cf_envs[CF_MAX_ENVS] = { 0 };
 static size_t cf_num_envs = 0;
 
+/* Variables the running target depends on, cenv_hash is the XOR of their terms */
+static cf_env_dep_t cf_env_deps[CF_MAX_ENVS] = { 0 };
+static size_t cf_num_env_deps = 0;
+static bool cf_env_frozen = false;
+/* Set once the running body loaded the variables it read during its last run */
+static bool cf_env_deps_loaded = false;
+
 static char* cf_jstrings[CF_MAX_JOIN_STRINGS] = { 0 };
 static size_t cf_num_jstrings = 0;
 
@@ -295,16 +586,35 @@ static size_t cf_num_splits = 0;
 static cf_map_entry_t cf_maps[CF_MAX_MAPS] = { 0 };
 static size_t cf_num_maps = 0;
 
-static char* cf_deferred_utd[CF_MAX_DEFERRED_UTD] = { 0 };
-static size_t cf_num_deferred_utd = 0;
+static void* cf_utd_batches[CF_MAX_UTD_BATCHES] = { 0 };
+static size_t cf_num_utd_batches = 0;
 
 static char* cf_fstrings[CF_MAX_FILE_STRINGS] = { 0 };
 static size_t cf_num_fstrings = 0;
 
+static cf_group_t* cf_groups[CF_MAX_GROUPS] = { 0 };
+static size_t cf_num_groups = 0;
+
 static cf_state_t cf_state = REGISTER_PHASE;
 
 static bool is_verbose_target = false;
 
+/* Target whose body is running on the main thread */
+static cf_target_decl_t* cf_cur_target = NULL;
+
+/* With -k: a CF_RUN(...) of the running body failed, the rest of it runs no commands */
+static bool cf_body_failed = false;
+
+/* Targets execute between planning and the final DB save, bodies on cf_main_thrd */
+static bool cf_build_running = false;
+static thrd_t cf_main_thrd;
+
+/* Job nodes queued outside of any target body */
+static cf_job_node_t* cf_unowned_jobs = NULL;
+
+/* Snapshot of environ shared by jobs until the environment changes */
+static cf_env_block_t* cf_env_block = NULL;
+
 static inline bool cf_empty_job(void) {
     return global_workq->front == global_workq->back;
 }
@@ -336,7 +646,7 @@ static bool cf_dequeue_job(cf_thrd_job* job) {
 
 static size_t cf_find_target_index(const char* target_name) {
     for (size_t i = cf_num_targets; i-- > 0;) {
-        if (strncmp(target_name, cf_targets[i].name, CF_MAX_NAME_LENGTH) == 0) {
+        if (cf_targets[i].base == NULL && strncmp(target_name, cf_targets[i].name, CF_MAX_NAME_LENGTH) == 0) {
             return i;
         }
     }
@@ -404,87 +714,55 @@ static void cf_register_config(const char* name, cf_config_fn fn) {
     };
 }
 
-__attribute__((unused)) static void cf_setenv_wrapper(const char* ident, char* value) {
-    if (cf_num_envs >= CF_MAX_ENVS) {
-        CF_ERR_LOG("Error: Maximum environment variables of %d was reached!\n", CF_MAX_ENVS);
-        exit(CF_MAX_REACHED_EC);
-    }
-
-    char* envvar = getenv(ident);
-    if (envvar == NULL) {
-        cf_envs[cf_num_envs++] = (cf_env_restore_t) {
-            .envname = ident,
-            .value = NULL,
-            .was_set = false
-        };
-    } else {
-        char* value_block = (char*) malloc(strlen(envvar) + 1);
-        if (value_block == NULL) {
-            CF_ERR_LOG("Error: malloc() failed in cf_setenv_wrapper()\n");
-            exit(CF_CLIB_FAIL_EC);
-        }
-
-        strcpy(value_block, envvar);
-        cf_envs[cf_num_envs++] = (cf_env_restore_t) {
-            .envname = ident,
-            .value = value_block,
-            .was_set = true
-        };
-    }
+static void cf_env_block_release(cf_env_block_t* block) {
+    mtx_lock(&global_workq->lock);
+    bool last = (--block->refs == 0);
+    mtx_unlock(&global_workq->lock);
 
-    if (setenv(ident, value, 1) != 0) {
-        CF_ERR_LOG("Error: setenv() failed in cf_setenv_wrapper()\n");
-        exit(CF_CLIB_FAIL_EC);
+    if (last) {
+        free(block);
     }
 }
 
-__attribute__((unused)) static void cf_joinenv_wrapper(bool is_append, const char* ident, char* value) {
-    const char* envvar = getenv(ident);
-    if (envvar == NULL) {
-        cf_setenv_wrapper(ident, value);
-        return;
+/* Returns the current environment snapshot, copying environ if it changed */
+static cf_env_block_t* cf_env_snapshot(void) {
+    if (cf_env_block != NULL) {
+        return cf_env_block;
     }
 
-    size_t envvar_len = strlen(envvar);
-    size_t value_len = strlen(value);
+    size_t count = 0;
+    size_t bytes = 0;
+    for (char** entry = environ; *entry != NULL; entry++) {
+        bytes += strlen(*entry) + 1;
+        count++;
+    }
 
-    char* joined = (char*) malloc(envvar_len + value_len + 1);
-    if (joined == NULL) {
-        CF_ERR_LOG("Error: malloc() failed in cf_joinenv_wrapper()\n");
+    size_t head = sizeof(cf_env_block_t) + (count + 1) * sizeof(char*);
+    cf_env_block_t* block = (cf_env_block_t*) malloc(head + bytes);
+    if (block == NULL) {
+        CF_ERR_LOG("Error: malloc() failed in cf_env_snapshot()\n");
         exit(CF_CLIB_FAIL_EC);
     }
 
-    if (is_append) {
-        memcpy(joined, envvar, envvar_len);
-        memcpy(joined + envvar_len, value, value_len);
-        joined[envvar_len + value_len] = '\0';
-    } else {
-        memcpy(joined, value, value_len);
-        memcpy(joined + value_len, envvar, envvar_len);
-        joined[envvar_len + value_len] = '\0';
+    block->refs = 1;
+    block->envp = (char**) (block + 1);
+    char* cursor = (char*) block + head;
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(environ[i]) + 1;
+        memcpy(cursor, environ[i], len);
+        block->envp[i] = cursor;
+        cursor += len;
     }
-    
-    cf_setenv_wrapper(ident, joined);
-    free(joined);
-}
+    block->envp[count] = NULL;
 
-static void cf_restore_env(size_t env_checkpoint) {
-    cf_env_restore_t envres;
-    while (cf_num_envs > env_checkpoint) {
-        envres = cf_envs[--cf_num_envs];
-        if (!envres.was_set) {
-            if (unsetenv(envres.envname) != 0) {
-                CF_ERR_LOG("Error: unsetenv() failed in cf_restore_env()\n");
-                exit(CF_CLIB_FAIL_EC);
-            }
-        } else {
-            if (setenv(envres.envname, envres.value, 1) != 0) {
-                CF_ERR_LOG("Error: setenv() failed in cf_restore_env()\n");
-                exit(CF_CLIB_FAIL_EC);
-            }
-        }
+    cf_env_block = block;
+    return block;
+}
 
-        free(envres.value);
+static void cf_env_invalidate(void) {
+    if (cf_env_block != NULL) {
+        cf_env_block_release(cf_env_block);
+        cf_env_block = NULL;
     }
 }
 
@@ -1030,92 +1308,6 @@ static void cf_free_fstrings(size_t checkpoint) {
     }
 }
 
-static int cf_thrd_helper(void* queue) {
-    cf_work_queue* q = (cf_work_queue*) queue;
-    cf_thrd_job job;
-    mtx_t* lock = &q->lock;
-
-    while (true) {
-        mtx_lock(lock);
-        while (cf_empty_job()) {
-            if (q->active_jobs == 0) {
-                cnd_signal(&q->no_job);
-            }
-            cnd_wait(&q->new_job, lock);
-        }
-        cf_dequeue_job(&job);
-        cnd_signal(&q->free_slot);
-        mtx_unlock(lock);
-
-        if (job.command == NULL) {
-            break;
-        }
-
-        if (system((char*) job.command) != 0) {
-            CF_ERR_LOG("Error: Executing command \"%s\" failed\n", (char*) job.command);
-            exit(CF_CLIB_FAIL_EC);
-        }
-
-        free(job.command);
-        mtx_lock(lock);
-        --q->active_jobs;
-        mtx_unlock(lock);
-    }
-    
-    return 0;
-}
-
-__attribute__((unused)) static void cf_execute_command(bool is_parallel, char* buffer) {
-    if (is_verbose_target) {
-        printf("%s\n", buffer);
-    }
-
-    if (is_parallel) {
-        mtx_t* lock = &global_workq->lock;
-        mtx_lock(lock);
-
-        while (cf_full_job()) {
-            while (cf_num_thrds < CF_MAX_THRDS) {    
-                thrd_t worker_thread = 0;
-                if (thrd_create(&worker_thread, &cf_thrd_helper, (void*) global_workq) != thrd_success) {
-                    CF_ERR_LOG("Error: Thread failed during creation in cf_execute_command()\n");
-                    exit(CF_CLIB_FAIL_EC);
-                }
-
-                cf_thrd_pool[cf_num_thrds++] = worker_thread;
-            }
-
-            cnd_wait(&global_workq->free_slot, lock);
-        }
-
-        cf_enqueue_job((cf_thrd_job) {
-            .command = buffer,
-        });
-        ++global_workq->active_jobs;
-        cnd_signal(&global_workq->new_job);
-
-        if (global_workq->active_jobs > cf_num_thrds && cf_num_thrds < CF_MAX_THRDS) {
-            thrd_t worker_thread;
-            if (thrd_create(&worker_thread, &cf_thrd_helper, (void*) global_workq) != thrd_success) {
-                CF_ERR_LOG("Error: Thread failed during creation in cf_execute_command()\n");
-                exit(CF_CLIB_FAIL_EC);
-            }
-
-            cf_thrd_pool[cf_num_thrds++] = worker_thread;
-        }
-
-        mtx_unlock(lock);
-        return;
-    }
-
-    if (system(buffer) != 0) {
-        CF_ERR_LOG("Error: Executing command \"%s\" failed", (char*) buffer);
-        exit(CF_CLIB_FAIL_EC);
-    }
-
-    free(buffer);
-}
-
 /* Compact XXH64 implementation */
 static const uint64_t XXH64_P1 = 0x9E3779B185EBCA87;
 static const uint64_t XXH64_P2 = 0xC2B2AE3D27D4EB4F;
@@ -1143,31 +1335,25 @@ static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
     return xxh64_rotl(acc + input * XXH64_P2, 31) * XXH64_P1;
 }
 
-static uint64_t xxh64(uint8_t* data, size_t len, uint64_t seed) {
-    uint8_t* p = data;
-    uint8_t *end = p + len;
-    uint64_t h;
-
-    if (len >= 32) {
-        uint64_t v[] = {seed + XXH64_P1 + XXH64_P2, seed + XXH64_P2, seed, seed - XXH64_P1};
-        while (p <= end - 32) {
-            for (int i = 0; i < 4; i++) {
-                v[i] = xxh64_round(v[i], xxh64_read64(p + i * 8));
-            }
-
-            p += 32;
-        }
+static inline void xxh64_stripe(uint64_t* v, const uint8_t* p) {
+    for (int i = 0; i < 4; i++) {
+        v[i] = xxh64_round(v[i], xxh64_read64(p + i * 8));
+    }
+}
 
-        h = xxh64_rotl(v[0],1) + xxh64_rotl(v[1],7) + xxh64_rotl(v[2],12) + xxh64_rotl(v[3],18);
-        for (int i = 0; i < 4; i++) {
-            h = (h ^ xxh64_round(0, v[i])) * XXH64_P1 + XXH64_P4;
-        }
-    } else {
-        h = seed + XXH64_P5;
+/* Folds the four lanes into one, used once 32 bytes or more were hashed */
+static inline uint64_t xxh64_merge(const uint64_t* v) {
+    uint64_t h = xxh64_rotl(v[0],1) + xxh64_rotl(v[1],7) + xxh64_rotl(v[2],12) + xxh64_rotl(v[3],18);
+    for (int i = 0; i < 4; i++) {
+        h = (h ^ xxh64_round(0, v[i])) * XXH64_P1 + XXH64_P4;
     }
 
-    h += (uint64_t)len;
+    return h;
+}
 
+/* Mixes in the len unconsumed trailing bytes at p, any length, and avalanches the result */
+static uint64_t xxh64_finalize(uint64_t h, const uint8_t* p, size_t len) {
+    const uint8_t* end = p + len;
     while (p + 8 <= end) {
         h ^= xxh64_round(0, xxh64_read64(p));
         h = xxh64_rotl(h, 27) * XXH64_P1 + XXH64_P4;
@@ -1192,421 +1378,5484 @@ static uint64_t xxh64(uint8_t* data, size_t len, uint64_t seed) {
     return h;
 }
 
-/* CForge DB implementation */
-static void cf_db_free(cf_db_mem_t* db) {
-    if (db == NULL) {
-        return;
-    }
+static uint64_t xxh64(uint8_t* data, size_t len, uint64_t seed) {
+    const uint8_t* p = data;
+    const uint8_t* end = p + len;
+    uint64_t h;
 
-    cf_db_hdr_t* hdr = db->header;
-    if (hdr != NULL) {
-        free(hdr);
-        db->header = NULL;
+    if (len >= 32) {
+        uint64_t v[] = {seed + XXH64_P1 + XXH64_P2, seed + XXH64_P2, seed, seed - XXH64_P1};
+        while (p <= end - 32) {
+            xxh64_stripe(v, p);
+            p += 32;
+        }
+        h = xxh64_merge(v);
+    } else {
+        h = seed + XXH64_P5;
     }
 
-    cf_db_entry_t* entries = db->entries;
-    if (entries != NULL) {
-        free(entries);
-        db->entries = NULL;
-    }
+    return xxh64_finalize(h + (uint64_t) len, p, (size_t) (end - p));
+}
 
-    cf_db_lstring_t* strings = db->strings;
-    if (strings != NULL) {
-        free(strings);
-        db->strings = NULL;
-    }
+/* Streaming XXH64, digests match xxh64() over the concatenated input */
+typedef struct {
+    uint64_t v[4];
+    uint64_t total_len;
+    uint64_t seed;
+    uint8_t buf[32];
+    size_t buf_len;
+} xxh64_state_t;
+
+static inline void xxh64_init(xxh64_state_t* state, uint64_t seed) {
+    state->v[0] = seed + XXH64_P1 + XXH64_P2;
+    state->v[1] = seed + XXH64_P2;
+    state->v[2] = seed;
+    state->v[3] = seed - XXH64_P1;
+    state->total_len = 0;
+    state->seed = seed;
+    state->buf_len = 0;
+}
 
-    cf_db_entry_t* pentries = db->pending_entries;
-    if (pentries != NULL) {
-        free(pentries);
-        db->pending_entries = NULL;
+static void xxh64_update(xxh64_state_t* state, const uint8_t* data, size_t len) {
+    const uint8_t* p = data;
+    const uint8_t* end = p + len;
+    state->total_len += len;
+
+    if (state->buf_len > 0) {
+        size_t fill = 32 - state->buf_len;
+        if (len < fill) {
+            memcpy(state->buf + state->buf_len, p, len);
+            state->buf_len += len;
+            return;
+        }
+
+        memcpy(state->buf + state->buf_len, p, fill);
+        xxh64_stripe(state->v, state->buf);
+        state->buf_len = 0;
+        p += fill;
     }
 
-    cf_db_lstring_t* pstrings = db->pending_strings;
-    if (pstrings != NULL) {
-        free(pstrings);
-        db->pending_strings = NULL;
+    while (end - p >= 32) {
+        xxh64_stripe(state->v, p);
+        p += 32;
     }
 
-    free(db);
+    state->buf_len = (size_t) (end - p);
+    memcpy(state->buf, p, state->buf_len);
 }
 
-static cf_db_mem_t* cf_db_load(const char* db_path) {
-    FILE* fp = fopen(db_path, "rb");
+static uint64_t xxh64_digest(const xxh64_state_t* state) {
+    uint64_t h = (state->total_len >= 32) ? xxh64_merge(state->v) : state->seed + XXH64_P5;
+    return xxh64_finalize(h + state->total_len, state->buf, state->buf_len);
+}
 
-    cf_db_mem_t* db = (cf_db_mem_t*) malloc(sizeof(cf_db_mem_t));
-    cf_db_hdr_t* hdr = (cf_db_hdr_t*) malloc(sizeof(cf_db_hdr_t));
-    cf_db_entry_t* pentries = (cf_db_entry_t*) malloc(CF_INIT_PENDING_ENTRIES * sizeof(cf_db_entry_t));
-    cf_db_lstring_t* pstrings = (cf_db_lstring_t*) malloc(CF_INIT_PENDING_STRING_SZ);
-    if (db == NULL || hdr == NULL || pentries == NULL || pstrings == NULL) {
-        CF_ERR_LOG("Error: malloc() failed in cf_load_db() for db_mem\n");
-        if (fp != NULL) {
-            fclose(fp);
+/* A variable's share of cenv_hash; unset and empty variables hash differently */
+static uint64_t cf_env_term(const char* name) {
+    const char* value = getenv(name);
+    uint64_t term = xxh64((uint8_t*) name, strlen(name), 0);
+    return (value == NULL) ? term : xxh64((uint8_t*) value, strlen(value), term + 1);
+}
+
+static size_t cf_env_dep_find(const char* name) {
+    for (size_t i = 0; i < cf_num_env_deps; i++) {
+        if (strcmp(cf_env_deps[i].name, name) == 0) {
+            return i;
         }
-    
-        free(hdr);
-        free(pentries);
-        free(pstrings);
-        free(db);
-        exit(CF_CLIB_FAIL_EC);
     }
 
-    memset(db, 0, sizeof(cf_db_mem_t));
-    db->header = hdr;
-    db->pending_entries = pentries;
-    db->pending_strings = pstrings;
-    db->pentries_max = CF_INIT_PENDING_ENTRIES;
-    db->pstrings_sz = CF_INIT_PENDING_STRING_SZ;
-    db->pentries_idx = 0;
-    db->pstrings_off = 0;
+    return SIZE_MAX;
+}
 
-    /* Default when DB not found */
-    if (fp == NULL) {
-        CF_WRN_LOG("Warning: DB at path not found, using default\n");
-        hdr->magic_header = CF_MAGIC_HEADER_VALUE;
-        hdr->version = CF_DB_CVERSION;
-        hdr->reserved = 0;
-        hdr->entry_cnt = 0;
-        hdr->string_sz = 0;
-        db->entries = NULL;
-        db->strings = NULL;
-        return db;
+static void cf_env_dep_add(const char* name, cf_env_dep_kind_t kind) {
+    if (cf_num_env_deps >= CF_MAX_ENVS) {
+        CF_ERR_LOG("Error: Maximum environment dependencies of %d was reached!\n", CF_MAX_ENVS);
+        exit(CF_MAX_REACHED_EC);
     }
 
-    if (fread(hdr, sizeof(cf_db_hdr_t), 1, fp) != 1) {
-        CF_ERR_LOG("Error: Could not read database header\n");   
-        fclose(fp);
-        cf_db_free(db);
-        exit(CF_DB_FAIL_EC);
+    char* name_copy = strdup(name);
+    if (name_copy == NULL) {
+        CF_ERR_LOG("Error: strdup() failed in cf_env_dep_add()\n");
+        exit(CF_CLIB_FAIL_EC);
     }
 
-    if (hdr->magic_header != CF_MAGIC_HEADER_VALUE) {
-        CF_ERR_LOG("Error: Magic database header code is invalid!\n");
-        fclose(fp);
-        cf_db_free(db);
-        exit(CF_DB_FAIL_EC);
+    uint64_t term = (kind == ENV_DEP_LOCAL) ? 0 : cf_env_term(name);
+    cf_env_deps[cf_num_env_deps++] = (cf_env_dep_t) {
+        .name = name_copy,
+        .term = term,
+        .kind = kind,
+    };
+    cenv_hash ^= term;
+}
+
+/*
+ * Called after a variable changed. Until the body of the running target
+ * starts, the change is folded into cenv_hash; afterwards it would only make
+ * the marks of this run disagree with the checks of the next one.
+ */
+static void cf_env_changed(const char* name) {
+    size_t idx = cf_env_dep_find(name);
+    if (idx == SIZE_MAX) {
+        cf_env_dep_add(name, cf_env_frozen ? ENV_DEP_LOCAL : ENV_DEP_CONFIG);
+        return;
     }
 
-    if (hdr->version != CF_DB_CVERSION) {
-        CF_ERR_LOG("Error: CForge version (v%d) does not match database version (v%d)\n", CF_DB_CVERSION, hdr->version);
-        fclose(fp);
-        cf_db_free(db);
-        exit(CF_DB_FAIL_EC);
+    cf_env_dep_t* dep = &cf_env_deps[idx];
+    if (!cf_env_frozen && dep->kind != ENV_DEP_LOCAL) {
+        uint64_t term = cf_env_term(name);
+        cenv_hash ^= dep->term ^ term;
+        dep->term = term;
     }
+}
 
-    cf_db_entry_t* entries = (cf_db_entry_t*) malloc(hdr->entry_cnt * sizeof(cf_db_entry_t));
-    if (entries == NULL) {
-        CF_ERR_LOG("Error: malloc() failed in cf_load_db() for entries\n");
-        fclose(fp);
-        cf_db_free(db);
-        exit(CF_CLIB_FAIL_EC);
+/* CF_ENV(...): the first read of a variable makes the running target depend on it */
+__attribute__((unused)) static char* cf_getenv_wrapper(const char* ident) {
+    if (cf_env_dep_find(ident) == SIZE_MAX) {
+        cf_env_dep_add(ident, ENV_DEP_READ);
     }
 
-    if (fread(entries, sizeof(cf_db_entry_t), hdr->entry_cnt, fp) != hdr->entry_cnt) {  
-        CF_ERR_LOG("Error: Could not read database entries\n");
-        fclose(fp);
-        cf_db_free(db);
-        exit(CF_DB_FAIL_EC);
+    return getenv(ident);
+}
+
+static void cf_env_untrack(size_t checkpoint) {
+    while (cf_num_env_deps > checkpoint) {
+        cf_env_dep_t* dep = &cf_env_deps[--cf_num_env_deps];
+        cenv_hash ^= dep->term;
+        free(dep->name);
+        dep->name = NULL;
     }
+}
 
-    cf_db_lstring_t* strings = (cf_db_lstring_t*) malloc(hdr->string_sz);
-    if (strings == NULL) {
-        CF_ERR_LOG("Error: malloc() failed in cf_load_db() for strings\n");
-        fclose(fp);
-        cf_db_free(db);
-        exit(CF_CLIB_FAIL_EC);
+__attribute__((unused)) static void cf_setenv_wrapper(const char* ident, char* value) {
+    if (cf_num_envs >= CF_MAX_ENVS) {
+        CF_ERR_LOG("Error: Maximum environment variables of %d was reached!\n", CF_MAX_ENVS);
+        exit(CF_MAX_REACHED_EC);
     }
 
-    if (fread(strings, 1, hdr->string_sz, fp) != hdr->string_sz) {  
-        CF_ERR_LOG("Error: Could not read database entries\n");
-        fclose(fp);
-        cf_db_free(db);
-        exit(CF_DB_FAIL_EC);
+    char* envvar = getenv(ident);
+    if (envvar == NULL) {
+        cf_envs[cf_num_envs++] = (cf_env_restore_t) {
+            .envname = ident,
+            .value = NULL,
+            .was_set = false
+        };
+    } else {
+        char* value_block = (char*) malloc(strlen(envvar) + 1);
+        if (value_block == NULL) {
+            CF_ERR_LOG("Error: malloc() failed in cf_setenv_wrapper()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+
+        strcpy(value_block, envvar);
+        cf_envs[cf_num_envs++] = (cf_env_restore_t) {
+            .envname = ident,
+            .value = value_block,
+            .was_set = true
+        };
     }
-    
-    db->entries = entries;
-    db->strings = strings;
-    fclose(fp);
-    return db;
+
+    if (setenv(ident, value, 1) != 0) {
+        CF_ERR_LOG("Error: setenv() failed in cf_setenv_wrapper()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    cf_env_changed(ident);
+    cf_env_invalidate();
 }
 
-static void cf_db_save(const char* db_path, cf_db_mem_t* db) {
-    if (db == NULL) {
-        CF_ERR_LOG("Error: db passed to cf_save_db() is NULL");
+__attribute__((unused)) static void cf_joinenv_wrapper(bool is_append, const char* ident, char* value) {
+    const char* envvar = cf_getenv_wrapper(ident);
+    if (envvar == NULL) {
+        cf_setenv_wrapper(ident, value);
         return;
     }
 
-    FILE* fp = fopen(db_path, "wb");
-    if (fp == NULL) {
-        CF_ERR_LOG("Error: Could not open database file\n");
-        cf_db_free(db);
-        exit(CF_DB_FAIL_EC);
+    size_t envvar_len = strlen(envvar);
+    size_t value_len = strlen(value);
+
+    char* joined = (char*) malloc(envvar_len + value_len + 1);
+    if (joined == NULL) {
+        CF_ERR_LOG("Error: malloc() failed in cf_joinenv_wrapper()\n");
+        exit(CF_CLIB_FAIL_EC);
     }
 
-    cf_db_hdr_t* hdr = db->header;
-    size_t entry_cnt = hdr->entry_cnt;
-    size_t string_sz = hdr->string_sz;
-    hdr->entry_cnt += db->pentries_idx;
-    hdr->string_sz += db->pstrings_off;
-    if(fwrite(hdr, sizeof(cf_db_hdr_t), 1, fp) != 1) {
-        CF_ERR_LOG("Error: Could not write database header\n");
-        fclose(fp);
-        cf_db_free(db);
-        exit(CF_DB_FAIL_EC);
+    if (is_append) {
+        memcpy(joined, envvar, envvar_len);
+        memcpy(joined + envvar_len, value, value_len);
+        joined[envvar_len + value_len] = '\0';
+    } else {
+        memcpy(joined, value, value_len);
+        memcpy(joined + value_len, envvar, envvar_len);
+        joined[envvar_len + value_len] = '\0';
     }
+    
+    cf_setenv_wrapper(ident, joined);
+    free(joined);
+}
 
-    if (db->entries != NULL) {
-        if (fwrite(db->entries, sizeof(cf_db_entry_t), entry_cnt, fp) != entry_cnt) {
-            CF_ERR_LOG("Error: Could not write database entries\n");
-            fclose(fp);
-            cf_db_free(db);
-            exit(CF_DB_FAIL_EC);
-        }
+static void cf_restore_env(size_t env_checkpoint) {
+    cf_env_restore_t envres;
+    if (cf_num_envs > env_checkpoint) {
+        cf_env_invalidate();
     }
 
-    if (db->pentries_idx > 0) {
-        for (size_t i = 0; i < db->pentries_idx; i++) {
-            cf_db_entry_t patched = db->pending_entries[i];
-            patched.path_offset += string_sz;
-            if (fwrite(&patched, sizeof(cf_db_entry_t), 1, fp) != 1) {
-                CF_ERR_LOG("Error: Could not write new database entries\n");
-                fclose(fp);
-                cf_db_free(db);
-                exit(CF_DB_FAIL_EC);
+    while (cf_num_envs > env_checkpoint) {
+        envres = cf_envs[--cf_num_envs];
+        if (!envres.was_set) {
+            if (unsetenv(envres.envname) != 0) {
+                CF_ERR_LOG("Error: unsetenv() failed in cf_restore_env()\n");
+                exit(CF_CLIB_FAIL_EC);
+            }
+        } else {
+            if (setenv(envres.envname, envres.value, 1) != 0) {
+                CF_ERR_LOG("Error: setenv() failed in cf_restore_env()\n");
+                exit(CF_CLIB_FAIL_EC);
             }
         }
+
+        cf_env_changed(envres.envname);
+        free(envres.value);
     }
+}
 
-    if (db->strings != NULL) {
-        if (fwrite(db->strings, 1, string_sz, fp) != string_sz) {
-            CF_ERR_LOG("Error: Could not write database strings\n");
-            fclose(fp);
-            cf_db_free(db);
-            exit(CF_DB_FAIL_EC);
+/*
+ * Wide-lane hash (XXH3-style accumulator layout) used for file contents and
+ * paths. Eight 64-bit lanes consume 64-byte stripes; the key shifts by one
+ * word per stripe and the lanes are scrambled every CF_WH_BLOCK_STRIPES
+ * stripes. The SSE2/AVX2 kernels compute exactly the scalar result.
+ */
+#define CF_WH_LANES 8
+#define CF_WH_STRIPE_SZ 64
+#define CF_WH_BLOCK_STRIPES 16
+#define CF_WH_SCRAMBLE_KEY (CF_WH_BLOCK_STRIPES + CF_WH_LANES)
+#define CF_WH_SECRET_WORDS (CF_WH_SCRAMBLE_KEY + CF_WH_LANES)
+#define CF_WH_P32 0x9E3779B1u
+
+typedef void (*cf_wh_kernel_fn)(uint64_t* acc, const uint8_t* p, size_t stripe, size_t nstripes);
+
+typedef struct {
+    uint64_t acc[CF_WH_LANES];
+    uint64_t total_len;
+    uint64_t seed;
+    /* Stripe position within the current scramble block */
+    size_t stripe;
+    uint8_t buf[CF_WH_STRIPE_SZ];
+    size_t buf_len;
+} cf_wh_state_t;
+
+static uint64_t cf_wh_secret[CF_WH_SECRET_WORDS];
+static cf_wh_kernel_fn cf_wh_kernel = NULL;
+static once_flag cf_wh_once = ONCE_FLAG_INIT;
+
+static void cf_wh_kernel_scalar(uint64_t* acc, const uint8_t* p, size_t stripe, size_t nstripes) {
+    for (size_t n = 0; n < nstripes; n++, p += CF_WH_STRIPE_SZ) {
+        const uint64_t* key = cf_wh_secret + stripe;
+        for (int i = 0; i < CF_WH_LANES; i++) {
+            uint64_t d = xxh64_read64(p + i * 8);
+            uint64_t dk = d ^ key[i];
+            acc[i ^ 1] += d;
+            acc[i] += (dk & 0xFFFFFFFF) * (dk >> 32);
         }
-    }
 
-    if (db->pstrings_off > 0) {
-        if (fwrite(db->pending_strings, 1, db->pstrings_off, fp) != db->pstrings_off) {
-            CF_ERR_LOG("Error: Could not write new database strings\n");
-            fclose(fp);
-            cf_db_free(db);
-            exit(CF_DB_FAIL_EC);
+        if (++stripe == CF_WH_BLOCK_STRIPES) {
+            for (int i = 0; i < CF_WH_LANES; i++) {
+                uint64_t a = acc[i];
+                a ^= a >> 47;
+                a ^= cf_wh_secret[CF_WH_SCRAMBLE_KEY + i];
+                acc[i] = a * CF_WH_P32;
+            }
+
+            stripe = 0;
         }
     }
-
-    fclose(fp);
-    cf_db_free(db);
 }
 
-static cf_db_entry_t* cf_db_find(char* path, cf_db_mem_t* db) {
-    size_t plen = strlen(path);
-    uint64_t hash = xxh64((uint8_t*) path, plen, 0);
-    for (size_t i = 0; i < db->pentries_idx; i++) {
-        cf_db_entry_t* entry = &db->pending_entries[i];
-        if (hash == entry->path_hash) {
-            uint8_t* slab = (uint8_t*) db->pending_strings;
-            uint16_t strl;
-            memcpy(&strl, slab + entry->path_offset, sizeof(strl));
-            char* strptr = (char*) (slab + entry->path_offset + sizeof(uint16_t));
-            if (strncmp(path, strptr, strl) == 0) {
-                return entry;
-            } else {
-                CF_WRN_LOG("Warning: Path hash collision detected!\n");
+#ifdef CF_WH_X86
+static void cf_wh_kernel_sse2(uint64_t* acc, const uint8_t* p, size_t stripe, size_t nstripes) {
+    __m128i a[4];
+    for (int i = 0; i < 4; i++) {
+        a[i] = _mm_loadu_si128((const __m128i*) (acc + i * 2));
+    }
+
+    const __m128i p32 = _mm_set1_epi32((int) CF_WH_P32);
+    for (size_t n = 0; n < nstripes; n++, p += CF_WH_STRIPE_SZ) {
+        const uint64_t* key = cf_wh_secret + stripe;
+        for (int i = 0; i < 4; i++) {
+            __m128i d = _mm_loadu_si128((const __m128i*) (p + i * 16));
+            __m128i dk = _mm_xor_si128(d, _mm_loadu_si128((const __m128i*) (key + i * 2)));
+            __m128i prod = _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+            a[i] = _mm_add_epi64(a[i], _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+            a[i] = _mm_add_epi64(a[i], prod);
+        }
+
+        if (++stripe == CF_WH_BLOCK_STRIPES) {
+            for (int i = 0; i < 4; i++) {
+                __m128i x = _mm_xor_si128(a[i], _mm_srli_epi64(a[i], 47));
+                x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i*) (cf_wh_secret + CF_WH_SCRAMBLE_KEY + i * 2)));
+                __m128i lo = _mm_mul_epu32(x, p32);
+                __m128i hi = _mm_mul_epu32(_mm_srli_epi64(x, 32), p32);
+                a[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
             }
+
+            stripe = 0;
         }
     }
 
-    if (db->entries == NULL || db->strings == NULL) {
-        return NULL;
+    for (int i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i*) (acc + i * 2), a[i]);
     }
+}
 
-    for (size_t i = 0; i < db->header->entry_cnt; i++) {
-        cf_db_entry_t* entry = &db->entries[i];
-        if (hash == entry->path_hash) {
-            uint8_t* slab = (uint8_t*) db->strings;
-            uint16_t strl;
-            memcpy(&strl, slab + entry->path_offset, sizeof(strl));
-            char* strptr = (char*) (slab + entry->path_offset + sizeof(uint16_t));
-            if (strncmp(path, strptr, strl) == 0) {
-                return &db->entries[i];
-            } else {
-                CF_WRN_LOG("Warning: Path hash collision detected!\n");
+__attribute__((target("avx2")))
+static void cf_wh_kernel_avx2(uint64_t* acc, const uint8_t* p, size_t stripe, size_t nstripes) {
+    __m256i a[2];
+    for (int i = 0; i < 2; i++) {
+        a[i] = _mm256_loadu_si256((const __m256i*) (acc + i * 4));
+    }
+
+    const __m256i p32 = _mm256_set1_epi32((int) CF_WH_P32);
+    for (size_t n = 0; n < nstripes; n++, p += CF_WH_STRIPE_SZ) {
+        const uint64_t* key = cf_wh_secret + stripe;
+        for (int i = 0; i < 2; i++) {
+            __m256i d = _mm256_loadu_si256((const __m256i*) (p + i * 32));
+            __m256i dk = _mm256_xor_si256(d, _mm256_loadu_si256((const __m256i*) (key + i * 4)));
+            __m256i prod = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+            a[i] = _mm256_add_epi64(a[i], _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+            a[i] = _mm256_add_epi64(a[i], prod);
+        }
+
+        if (++stripe == CF_WH_BLOCK_STRIPES) {
+            for (int i = 0; i < 2; i++) {
+                __m256i x = _mm256_xor_si256(a[i], _mm256_srli_epi64(a[i], 47));
+                x = _mm256_xor_si256(x, _mm256_loadu_si256((const __m256i*) (cf_wh_secret + CF_WH_SCRAMBLE_KEY + i * 4)));
+                __m256i lo = _mm256_mul_epu32(x, p32);
+                __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), p32);
+                a[i] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
             }
+
+            stripe = 0;
         }
     }
 
-    return NULL;
+    for (int i = 0; i < 2; i++) {
+        _mm256_storeu_si256((__m256i*) (acc + i * 4), a[i]);
+    }
+}
+#endif // CF_WH_X86
+
+static void cf_wh_setup(void) {
+    /* splitmix64 keeps the secret reproducible across builds and platforms */
+    uint64_t x = XXH64_P1;
+    for (size_t i = 0; i < CF_WH_SECRET_WORDS; i++) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+        cf_wh_secret[i] = z ^ (z >> 31);
+    }
+
+    cf_wh_kernel = cf_wh_kernel_scalar;
+#ifdef CF_WH_X86
+    __builtin_cpu_init();
+    cf_wh_kernel = __builtin_cpu_supports("avx2") ? cf_wh_kernel_avx2 : cf_wh_kernel_sse2;
+#endif // CF_WH_X86
 }
 
-static bool cf_db_hash_file(char* path, uint64_t* hash) {
-#ifdef CF_DISABLE_FILE_HASH
-    (void) path;
-    *hash = 0;
-    return true;
-#else
-    FILE* fp = fopen(path, "rb");
-    if (fp == NULL) {
-        return false;
+static inline void cf_wh_init(cf_wh_state_t* state, uint64_t seed) {
+    call_once(&cf_wh_once, cf_wh_setup);
+    for (int i = 0; i < CF_WH_LANES; i++) {
+        state->acc[i] = seed + XXH64_P1 * (uint64_t) (i + 1);
     }
 
-    if (fseek(fp, 0, SEEK_END) != 0) {
-        fclose(fp);
-        return false;
+    state->total_len = 0;
+    state->seed = seed;
+    state->stripe = 0;
+    state->buf_len = 0;
+}
+
+static void cf_wh_update(cf_wh_state_t* state, const uint8_t* data, size_t len) {
+    const uint8_t* p = data;
+    state->total_len += len;
+
+    if (state->buf_len > 0) {
+        size_t fill = CF_WH_STRIPE_SZ - state->buf_len;
+        if (len < fill) {
+            memcpy(state->buf + state->buf_len, p, len);
+            state->buf_len += len;
+            return;
+        }
+
+        memcpy(state->buf + state->buf_len, p, fill);
+        cf_wh_kernel(state->acc, state->buf, state->stripe, 1);
+        state->stripe = (state->stripe + 1) % CF_WH_BLOCK_STRIPES;
+        state->buf_len = 0;
+        p += fill;
+        len -= fill;
     }
 
-    ssize_t sz = ftell(fp);
-    if (sz < 0) {
-        fclose(fp);
-        return false;
+    size_t nstripes = len / CF_WH_STRIPE_SZ;
+    if (nstripes > 0) {
+        cf_wh_kernel(state->acc, p, state->stripe, nstripes);
+        state->stripe = (state->stripe + nstripes) % CF_WH_BLOCK_STRIPES;
+        p += nstripes * CF_WH_STRIPE_SZ;
+        len -= nstripes * CF_WH_STRIPE_SZ;
     }
 
-    rewind(fp);
-    uint8_t* buf = (uint8_t*) malloc((size_t) sz + 1);
-    if (buf == NULL) {
-        CF_ERR_LOG("Error: malloc() failed in cf_db_hash_file()\n");
-        exit(CF_CLIB_FAIL_EC);
+    state->buf_len = len;
+    memcpy(state->buf, p, len);
+}
+
+static uint64_t cf_wh_digest(const cf_wh_state_t* state) {
+    uint64_t h = state->seed + XXH64_P5 + state->total_len * XXH64_P1;
+    for (int i = 0; i < CF_WH_LANES; i++) {
+        h = (h ^ xxh64_round(0, state->acc[i])) * XXH64_P1 + XXH64_P4;
     }
 
-    if (fread(buf, 1, (size_t) sz, fp) != (size_t) sz) {
-        fclose(fp);
-        free(buf);
-        return false;
+    return xxh64_finalize(h, state->buf, state->buf_len);
+}
+
+static uint64_t cf_wh(const uint8_t* data, size_t len, uint64_t seed) {
+    cf_wh_state_t state;
+    cf_wh_init(&state, seed);
+    cf_wh_update(&state, data, len);
+    return cf_wh_digest(&state);
+}
+
+/* Anything outside this set (quotes, globs, redirections, ...) needs sh */
+static inline bool cf_is_plain_command_char(char chr) {
+    if ((chr >= 'a' && chr <= 'z') || (chr >= 'A' && chr <= 'Z') || (chr >= '0' && chr <= '9')) {
+        return true;
     }
 
-    fclose(fp);
-    buf[sz] = '\0';
-    *hash = xxh64(buf, (size_t) sz, 0);
-    free(buf);
-    return true;
-#endif // CF_DISABLE_FILE_HASH
+    return strchr("-_./,:+@%= \t", chr) != NULL;
 }
 
-__attribute__((unused)) static void cf_db_mark_utd(char* path, cf_db_mem_t* db) {
-    cf_db_entry_t* entry = cf_db_find(path, global_db);
-    bool is_new = (entry == NULL);
-    size_t saved_pstrings_off = db->pstrings_off;
-    size_t saved_pentries_idx = db->pentries_idx;
+/* Builtins and reserved words only sh can run, the rest of them aren't plain words anyway */
+static const char* const cf_shell_words[] = {
+    ".", ":", "alias", "bg", "break", "case", "cd", "command", "continue", "do", "done",
+    "elif", "else", "esac", "eval", "exec", "exit", "export", "fc", "fg", "fi", "for", "function",
+    "getopts", "hash", "if", "jobs", "local", "read", "readonly", "return", "select", "set", "shift",
+    "source", "then", "times", "trap", "type", "ulimit", "umask", "unalias", "unset", "until", "wait",
+    "while"
+};
+
+static bool cf_is_shell_word(const char* word) {
+    for (size_t i = 0; i < sizeof(cf_shell_words) / sizeof(cf_shell_words[0]); i++) {
+        if (strcmp(word, cf_shell_words[i]) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
 
-    if (is_new) {
-        size_t str_offset = db->pstrings_off;
-        size_t strl = strlen(path);
-        if (strl > UINT16_MAX) {
-            CF_ERR_LOG("Error: Path length exceeds UINT16 length\n");
-            exit(CF_MAX_REACHED_EC);
+/*
+ * Splits a command into argv in place when it can be run without a shell.
+ * A leading VAR=value word is a shell assignment, so '=' is only accepted
+ * after the program name.
+ */
+static bool cf_split_plain_command(char* command, char** argv, size_t max_args) {
+    for (const char* chr = command; *chr != '\0'; chr++) {
+        if (!cf_is_plain_command_char(*chr)) {
+            return false;
         }
-        size_t needed = sizeof(uint16_t) + strl + 1;
-        if (str_offset + needed > db->pstrings_sz) {
-            CF_ERR_LOG("Error: Pending strings buffer ran out of space!");
-            exit(CF_MAX_REACHED_EC);
+    }
+
+    size_t argc = 0;
+    char* cursor = command;
+    while (*cursor != '\0') {
+        while (*cursor == ' ' || *cursor == '\t') {
+            *cursor++ = '\0';
         }
 
-        uint8_t* slab = (uint8_t*) db->pending_strings;
-        uint16_t len16 = (uint16_t) strl;
-        memcpy(slab + db->pstrings_off, &len16, sizeof(len16));
-        memcpy(slab + db->pstrings_off + sizeof(uint16_t), path, strl + 1);
+        if (*cursor == '\0') {
+            break;
+        }
 
-        size_t idx = db->pentries_idx;
-        if (idx >= db->pentries_max) {
-            CF_ERR_LOG("Error: Pending entries buffer ran out of space!");
-            exit(CF_MAX_REACHED_EC);
+        if (argc + 1 >= max_args) {
+            return false;
         }
 
-        entry = &db->pending_entries[idx];
-        entry->path_offset = str_offset;
-        entry->path_hash = xxh64((uint8_t*) path, strl, 0);
-        db->pentries_idx++;
-        db->pstrings_off += needed;
+        argv[argc++] = cursor;
+        while (*cursor != '\0' && *cursor != ' ' && *cursor != '\t') {
+            cursor++;
+        }
     }
 
-    struct stat st;
-    if (stat(path, &st) == -1) {
-        db->pstrings_off = saved_pstrings_off;
-        db->pentries_idx = saved_pentries_idx;
-        return;
+    argv[argc] = NULL;
+    return argc > 0 && strchr(argv[0], '=') == NULL && !cf_is_shell_word(argv[0]);
+}
+
+/*
+ * execvp()-style program lookup against the PATH in envp. posix_spawnp()
+ * would search our own environment, which the main thread may be changing.
+ */
+static bool cf_find_program(const char* name, char* const* envp, char* out, size_t size) {
+    if (strchr(name, '/') != NULL) {
+        return snprintf(out, size, "%s", name) < (int) size;
     }
 
-    uint64_t hash = 0;
-    if (!cf_db_hash_file(path, &hash)) {
-        db->pstrings_off = saved_pstrings_off;
-        db->pentries_idx = saved_pentries_idx;
-        return;
+    const char* path = "/usr/bin:/bin";
+    for (char* const* entry = envp; *entry != NULL; entry++) {
+        if (strncmp(*entry, "PATH=", 5) == 0) {
+            path = *entry + 5;
+            break;
+        }
+    }
+
+    const char* dir = path;
+    while (true) {
+        const char* end = strchr(dir, ':');
+        int len = (int) ((end != NULL) ? (size_t) (end - dir) : strlen(dir));
+        int n = snprintf(out, size, "%.*s%s%s", len, dir, (len > 0) ? "/" : "", name);
+
+        struct stat st;
+        if (n > 0 && n < (int) size && stat(out, &st) == 0 && S_ISREG(st.st_mode) && access(out, X_OK) == 0) {
+            return true;
+        }
+
+        if (end == NULL) {
+            return false;
+        }
+        dir = end + 1;
+    }
+}
+
+/*
+ * Every command is registered here until it exits. Parallel jobs run in a
+ * process group of their own, commands of the body stay in our foreground
+ * group so they can use the terminal. The watchdog thread sends SIGTERM to
+ * a command (its whole group if it has one) once its timeout passed or the
+ * build was cancelled, and SIGKILL CF_KILL_GRACE_MS later, so neither a hung
+ * command nor a failed build leaves processes behind.
+ */
+typedef struct {
+    pid_t pid;
+    bool own_group;
+    /* CLOCK_MONOTONIC deadlines in ms, 0 when not armed */
+    uint64_t term_at;
+    uint64_t kill_at;
+    bool timed_out;
+    bool cancelled;
+} cf_child_t;
+
+static mtx_t cf_child_lock;
+static cnd_t cf_child_changed;
+static cf_child_t* cf_children = NULL;
+static size_t cf_num_children = 0;
+static size_t cf_children_cap = 0;
+/* Set by main() once the watchdog runs, commands are not tracked before */
+static bool cf_children_ready = false;
+static bool cf_children_cancelled = false;
+
+/* Wall-clock limit per command in seconds from --timeout or CF_TIMEOUT, 0 disables */
+static uint64_t cf_job_timeout_s = 0;
+
+static void cf_child_kill(const cf_child_t* child, int sig) {
+    kill(child->own_group ? -child->pid : child->pid, sig);
+}
+
+static uint64_t cf_monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000ull + (uint64_t) now.tv_nsec / 1000000ull;
+}
+
+static int cf_watchdog_thrd(void* arg) {
+    (void) arg;
+    mtx_lock(&cf_child_lock);
+    while (true) {
+        uint64_t now = cf_monotonic_ms();
+        uint64_t next = UINT64_MAX;
+        for (size_t i = 0; i < cf_num_children; i++) {
+            cf_child_t* child = &cf_children[i];
+            if (child->kill_at != 0 && child->kill_at <= now) {
+                cf_child_kill(child, SIGKILL);
+                child->kill_at = 0;
+            } else if (child->term_at != 0 && child->term_at <= now) {
+                cf_child_kill(child, SIGTERM);
+                child->timed_out = !child->cancelled;
+                child->term_at = 0;
+                child->kill_at = now + CF_KILL_GRACE_MS;
+            }
+
+            if (child->term_at != 0 && child->term_at < next) {
+                next = child->term_at;
+            }
+            if (child->kill_at != 0 && child->kill_at < next) {
+                next = child->kill_at;
+            }
+        }
+
+        if (next == UINT64_MAX) {
+            cnd_wait(&cf_child_changed, &cf_child_lock);
+            continue;
+        }
+
+        /* cnd_timedwait() takes a TIME_UTC deadline, the wait itself is relative */
+        struct timespec until;
+        timespec_get(&until, TIME_UTC);
+        uint64_t wait = next - now;
+        until.tv_sec += (time_t) (wait / 1000ull);
+        until.tv_nsec += (long) (wait % 1000ull) * 1000000l;
+        if (until.tv_nsec >= 1000000000l) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000l;
+        }
+        cnd_timedwait(&cf_child_changed, &cf_child_lock, &until);
+    }
+
+    return 0;
+}
+
+/*
+ * Stops every running command, once the build failed or was interrupted.
+ * No command starts afterwards. With force, the groups are killed right away.
+ */
+static void cf_cancel_children(bool force) {
+    if (!cf_children_ready) {
+        return;
+    }
+
+    mtx_lock(&cf_child_lock);
+    cf_children_cancelled = true;
+    uint64_t now = cf_monotonic_ms();
+    for (size_t i = 0; i < cf_num_children; i++) {
+        cf_child_t* child = &cf_children[i];
+        child->cancelled = true;
+        if (force) {
+            cf_child_kill(child, SIGKILL);
+        } else if (child->kill_at == 0) {
+            child->term_at = now;
+        }
+    }
+    cnd_signal(&cf_child_changed);
+    mtx_unlock(&cf_child_lock);
+}
+
+/* Called with cf_child_lock held, right after the command was spawned */
+static void cf_child_register(pid_t pid, bool own_group) {
+    if (cf_num_children >= cf_children_cap) {
+        size_t ncap = (cf_children_cap == 0) ? CF_INIT_THRDS : cf_children_cap * 2;
+        cf_child_t* nchildren = (cf_child_t*) realloc(cf_children, ncap * sizeof(cf_child_t));
+        if (nchildren == NULL) {
+            kill(own_group ? -pid : pid, SIGKILL);
+            mtx_unlock(&cf_child_lock);
+            CF_ERR_LOG("Error: realloc() failed in cf_child_register()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+
+        cf_children = nchildren;
+        cf_children_cap = ncap;
+    }
+
+    cf_child_t* child = &cf_children[cf_num_children++];
+    child->pid = pid;
+    child->own_group = own_group;
+    child->term_at = (cf_job_timeout_s > 0) ? cf_monotonic_ms() + cf_job_timeout_s * 1000ull : 0;
+    child->kill_at = 0;
+    child->timed_out = false;
+    child->cancelled = false;
+    if (child->term_at != 0) {
+        cnd_signal(&cf_child_changed);
+    }
+}
+
+/*
+ * Drops a command that exited but was not reaped yet, so its pid (and with it
+ * the process group) can't be reused while the watchdog may still signal it.
+ */
+static cf_child_t cf_child_release(pid_t pid) {
+    cf_child_t released = { 0 };
+    mtx_lock(&cf_child_lock);
+    for (size_t i = 0; i < cf_num_children; i++) {
+        if (cf_children[i].pid == pid) {
+            released = cf_children[i];
+            cf_children[i] = cf_children[--cf_num_children];
+            break;
+        }
+    }
+    mtx_unlock(&cf_child_lock);
+
+    return released;
+}
+
+/*
+ * Runs a command through posix_spawn() and waits for it. Unlike system(),
+ * this neither forks the whole process nor ignores SIGINT/SIGQUIT in the
+ * parent, and plain commands skip /bin/sh entirely.
+ * Only parallel commands get a process group of their own, see cf_child_t.
+ * Returns the wait status, or -1 if the command could not be spawned, timed
+ * out or was stopped by a cancelled build.
+ */
+static int cf_spawn_command(const char* command, char* const* envp, bool parallel) {
+    char plain[CF_MAX_COMMAND_LENGTH];
+    char* argv[CF_MAX_COMMAND_LENGTH / 2 + 1];
+    bool use_shell = true;
+
+    size_t len = strlen(command);
+    if (len < sizeof(plain)) {
+        memcpy(plain, command, len + 1);
+        use_shell = !cf_split_plain_command(plain, argv, sizeof(argv) / sizeof(argv[0]));
+    }
+
+    /* Programs not found in PATH go through sh as well, which reports them like system() did */
+    char program[PATH_MAX];
+    if (!use_shell && !cf_find_program(argv[0], envp, program, sizeof(program))) {
+        use_shell = true;
+    }
+
+    if (use_shell) {
+        argv[0] = (char*) "sh";
+        argv[1] = (char*) "-c";
+        argv[2] = (char*) command;
+        argv[3] = NULL;
+    }
+
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    sigset_t defaults;
+    sigemptyset(&mask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGTERM);
+    sigaddset(&defaults, SIGPIPE);
+    sigaddset(&defaults, SIGCHLD);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setpgroup(&attr, 0);
+    bool own_group = cf_children_ready && parallel;
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | (own_group ? POSIX_SPAWN_SETPGROUP : 0));
+
+    /* Spawned under the lock, so a cancellation either prevents or sees it */
+    if (cf_children_ready) {
+        mtx_lock(&cf_child_lock);
+        if (cf_children_cancelled) {
+            mtx_unlock(&cf_child_lock);
+            posix_spawnattr_destroy(&attr);
+            return -1;
+        }
+    }
+
+    pid_t pid;
+    int rc = posix_spawn(&pid, use_shell ? "/bin/sh" : program, NULL, &attr, argv, envp);
+
+    if (cf_children_ready) {
+        if (rc == 0) {
+            cf_child_register(pid, own_group);
+        }
+        mtx_unlock(&cf_child_lock);
+    }
+    posix_spawnattr_destroy(&attr);
+
+    if (rc != 0) {
+        CF_ERR_LOG("Error: Could not spawn \"%s\": %s\n", command, strerror(rc));
+        return -1;
+    }
+
+    /* Waiting without reaping keeps the pid ours until it is unregistered */
+    siginfo_t info;
+    while (waitid(P_PID, (id_t) pid, &info, WEXITED | WNOWAIT) < 0 && errno == EINTR) {
+    }
+    cf_child_t child = cf_children_ready ? cf_child_release(pid) : (cf_child_t) { 0 };
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            CF_ERR_LOG("Error: waitpid() failed for \"%s\"\n", command);
+            return -1;
+        }
+    }
+
+    if (child.timed_out) {
+        CF_ERR_LOG("Error: Command \"%s\" timed out after %llu s\n", command, (unsigned long long) cf_job_timeout_s);
+        return -1;
+    }
+
+    /* Stopped because the build failed or was interrupted, which was reported already */
+    if (child.cancelled && WIFSIGNALED(status)) {
+        return -1;
+    }
+
+    return status;
+}
+
+static bool cf_run_command(const char* command, char* const* envp, bool parallel) {
+    int status = cf_spawn_command(command, envp, parallel);
+    if (status < 0) {
+        return false;
+    }
+
+    if (WIFSIGNALED(status)) {
+        CF_ERR_LOG("Error: Command \"%s\" was killed by signal %d (%s)\n", command, WTERMSIG(status), strsignal(WTERMSIG(status)));
+        return false;
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        CF_ERR_LOG("Error: Executing command \"%s\" failed with exit status %d\n", command, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        return false;
+    }
+
+    return true;
+}
+
+#if defined(__linux__) || defined(linux)
+/* Our cgroup v2 path relative to /sys/fs/cgroup, e.g. "/user.slice/x" */
+static bool cf_cgroup_self(char* cgroup, size_t size) {
+    FILE* fp = fopen("/proc/self/cgroup", "r");
+    if (fp == NULL) {
+        return false;
+    }
+
+    char line[PATH_MAX];
+    bool found = false;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "0::/", 4) == 0) {
+            size_t len = strcspn(line + 3, "\n");
+            if (len < size) {
+                memcpy(cgroup, line + 3, len);
+                cgroup[len] = '\0';
+                found = true;
+            }
+            break;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+/* Steps to the parent cgroup, returns false once the root was visited */
+static bool cf_cgroup_parent(char* cgroup) {
+    if (strcmp(cgroup, "/") == 0) {
+        return false;
+    }
+
+    char* slash = strrchr(cgroup, '/');
+    slash[(slash == cgroup) ? 1 : 0] = '\0';
+    return true;
+}
+
+static FILE* cf_cgroup_open(const char* cgroup, const char* file) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "/sys/fs/cgroup%s/%s", (strcmp(cgroup, "/") == 0) ? "" : cgroup, file);
+    return fopen(path, "r");
+}
+
+/* Smallest cgroup v2 cpu.max quota on the path from our cgroup to the root */
+static size_t cf_cgroup_cpu_limit(void) {
+    char cgroup[PATH_MAX];
+    if (!cf_cgroup_self(cgroup, sizeof(cgroup))) {
+        return 0;
+    }
+
+    size_t limit = 0;
+    do {
+        FILE* fp = cf_cgroup_open(cgroup, "cpu.max");
+        if (fp == NULL) {
+            continue;
+        }
+
+        char quota[32];
+        unsigned long long period = 0;
+        if (fscanf(fp, "%31s %llu", quota, &period) == 2 && strcmp(quota, "max") != 0 && period > 0) {
+            unsigned long long cpus = (strtoull(quota, NULL, 10) + period - 1) / period;
+            if (cpus < 1) {
+                cpus = 1;
+            }
+
+            if (limit == 0 || cpus < limit) {
+                limit = (size_t) cpus;
+            }
+        }
+        fclose(fp);
+    } while (cf_cgroup_parent(cgroup));
+
+    return limit;
+}
+
+/* Headroom below the tightest cgroup v2 memory.max, UINT64_MAX if unlimited */
+static uint64_t cf_cgroup_mem_headroom(void) {
+    char cgroup[PATH_MAX];
+    uint64_t headroom = UINT64_MAX;
+    if (!cf_cgroup_self(cgroup, sizeof(cgroup))) {
+        return headroom;
+    }
+
+    do {
+        FILE* fp = cf_cgroup_open(cgroup, "memory.max");
+        if (fp == NULL) {
+            continue;
+        }
+
+        unsigned long long max = 0;
+        unsigned long long current = 0;
+        bool limited = fscanf(fp, "%llu", &max) == 1;
+        fclose(fp);
+        if (!limited) {
+            continue;
+        }
+
+        fp = cf_cgroup_open(cgroup, "memory.current");
+        if (fp == NULL) {
+            continue;
+        }
+
+        if (fscanf(fp, "%llu", &current) == 1) {
+            uint64_t left = (current < max) ? (uint64_t) (max - current) : 0;
+            if (left < headroom) {
+                headroom = left;
+            }
+        }
+        fclose(fp);
+    } while (cf_cgroup_parent(cgroup));
+
+    return headroom;
+}
+
+static uint64_t cf_mem_available(void) {
+    uint64_t available = UINT64_MAX;
+    FILE* fp = fopen("/proc/meminfo", "r");
+    if (fp != NULL) {
+        char line[256];
+        unsigned long long kib = 0;
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (sscanf(line, "MemAvailable: %llu kB", &kib) == 1) {
+                available = (uint64_t) kib * 1024;
+                break;
+            }
+        }
+        fclose(fp);
+    }
+
+    uint64_t headroom = cf_cgroup_mem_headroom();
+    return (headroom < available) ? headroom : available;
+}
+#else
+static inline uint64_t cf_mem_available(void) {
+    return UINT64_MAX;
+}
+#endif
+
+static size_t cf_detect_jobs(void) {
+    size_t cpus = 0;
+#if defined(__linux__) || defined(linux)
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        cpus = (size_t) CPU_COUNT(&set);
+    }
+
+    size_t quota = cf_cgroup_cpu_limit();
+    if (quota > 0 && (cpus == 0 || quota < cpus)) {
+        cpus = quota;
+    }
+#endif
+    if (cpus == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        cpus = (online > 0) ? (size_t) online : 1;
+    }
+
+    return cpus;
+}
+
+static size_t cf_parse_jobs(const char* value, const char* source) {
+    char* end = NULL;
+    errno = 0;
+    unsigned long long jobs = strtoull(value, &end, 10);
+    if (value[0] == '\0' || value[0] == '-' || *end != '\0' || errno != 0 || jobs == 0 || jobs > SIZE_MAX / 2) {
+        CF_ERR_LOG("Error: Invalid job count \"%s\" given by %s!\n", value, source);
+        exit(CF_INVALID_ARG_EC);
+    }
+
+    return (size_t) jobs;
+}
+
+static double cf_parse_load(const char* value) {
+    char* end = NULL;
+    errno = 0;
+    double load = strtod(value, &end);
+    if (value[0] == '\0' || *end != '\0' || errno != 0 || !(load > 0.0)) {
+        CF_ERR_LOG("Error: Invalid load average \"%s\" given by -l!\n", value);
+        exit(CF_INVALID_ARG_EC);
+    }
+
+    return load;
+}
+
+/* Parses a byte count with an optional K, M or G suffix */
+static uint64_t cf_parse_mem(const char* value) {
+    char* end = NULL;
+    errno = 0;
+    unsigned long long mem = strtoull(value, &end, 10);
+    unsigned shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; ++end; break;
+        case 'm': case 'M': shift = 20; ++end; break;
+        case 'g': case 'G': shift = 30; ++end; break;
+        default: break;
+    }
+
+    if (value[0] == '\0' || value[0] == '-' || *end != '\0' || errno != 0 || mem == 0 || mem > (UINT64_MAX >> shift)) {
+        CF_ERR_LOG("Error: Invalid memory size \"%s\" given by --min-free-mem!\n", value);
+        exit(CF_INVALID_ARG_EC);
+    }
+
+    return (uint64_t) mem << shift;
+}
+
+static uint64_t cf_parse_timeout(const char* value, const char* source) {
+    char* end = NULL;
+    errno = 0;
+    unsigned long long seconds = strtoull(value, &end, 10);
+    if (value[0] == '\0' || value[0] == '-' || *end != '\0' || errno != 0 || seconds > UINT32_MAX) {
+        CF_ERR_LOG("Error: Invalid timeout \"%s\" given by %s!\n", value, source);
+        exit(CF_INVALID_ARG_EC);
+    }
+
+    return (uint64_t) seconds;
+}
+
+/*
+ * Admission control for parallel commands. The load average lags behind by
+ * design, so commands admitted during the last second count towards it the
+ * same way GNU make -l does. One command is always allowed to run, otherwise
+ * a build could stall on load that it is not responsible for.
+ */
+static size_t cf_running_cmds = 0;
+static size_t cf_recent_cmds = 0;
+static time_t cf_recent_sec = 0;
+static bool cf_throttle_noted = false;
+
+static bool cf_under_pressure(size_t recent) {
+    if (cf_max_load > 0.0) {
+        double load = 0.0;
+        if (getloadavg(&load, 1) == 1 && load + (double) recent >= cf_max_load) {
+            return true;
+        }
+    }
+
+    return cf_min_free_mem > 0 && cf_mem_available() < cf_min_free_mem;
+}
+
+static void cf_admit_command(void) {
+    if (cf_max_load <= 0.0 && cf_min_free_mem == 0) {
+        return;
+    }
+
+    mtx_t* lock = &global_workq->lock;
+    const struct timespec poll = { .tv_sec = 0, .tv_nsec = CF_THROTTLE_POLL_NS };
+    while (true) {
+        time_t now = time(NULL);
+        mtx_lock(lock);
+        if (now != cf_recent_sec) {
+            cf_recent_sec = now;
+            cf_recent_cmds = 0;
+        }
+        size_t recent = cf_recent_cmds;
+        bool idle = cf_running_cmds == 0;
+        mtx_unlock(lock);
+
+        bool pressured = !idle && cf_under_pressure(recent);
+
+        mtx_lock(lock);
+        if (!pressured || cf_running_cmds == 0) {
+            ++cf_running_cmds;
+            ++cf_recent_cmds;
+            mtx_unlock(lock);
+            return;
+        }
+
+        if (!cf_throttle_noted) {
+            cf_throttle_noted = true;
+            CF_WRN_LOG("Warning: System under load or memory pressure, holding back new jobs\n");
+        }
+        mtx_unlock(lock);
+        thrd_sleep(&poll, NULL);
+    }
+}
+
+static void cf_retire_command(void) {
+    if (cf_max_load <= 0.0 && cf_min_free_mem == 0) {
+        return;
+    }
+
+    mtx_lock(&global_workq->lock);
+    --cf_running_cmds;
+    mtx_unlock(&global_workq->lock);
+}
+
+#ifndef CF_DISABLE_JOBSERVER
+/*
+ * GNU make jobserver. Every process owns one implicit token; each further
+ * concurrently running command needs a byte read from the jobserver, which
+ * is written back once the command finishes. An inherited jobserver (from
+ * MAKEFLAGS) is joined, otherwise CForge serves one to its children.
+ */
+typedef struct {
+    bool active;
+    bool implicit_free;
+    int32_t rfd;
+    int32_t wfd;
+    /* Non-blocking open of rfd where possible, so a token lost to another reader never blocks */
+    int32_t poll_fd;
+    /* Wakes the thread polling poll_fd when the implicit token is returned */
+    int32_t wake[2];
+    /* Only one thread polls, the others wait on turn for the implicit token or their turn */
+    bool polling;
+    cnd_t turn;
+    /* Tokens read from rfd and not written back yet, returned at exit */
+    unsigned char* held;
+    size_t num_held;
+    size_t held_cap;
+    bool closed;
+    mtx_t lock;
+} cf_jobserver_t;
+
+static cf_jobserver_t cf_jobserver = { 0 };
+
+static bool cf_jobserver_join(const char* makeflags) {
+    const char* auth = NULL;
+    const char* keys[] = { "--jobserver-auth=", "--jobserver-fds=" };
+    for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+        /* The last occurrence wins, like in make */
+        for (const char* hit = strstr(makeflags, keys[k]); hit != NULL; hit = strstr(hit + 1, keys[k])) {
+            auth = hit + strlen(keys[k]);
+        }
+
+        if (auth != NULL) {
+            break;
+        }
+    }
+
+    if (auth == NULL) {
+        return false;
+    }
+
+    if (strncmp(auth, "fifo:", 5) == 0) {
+        char path[PATH_MAX];
+        size_t len = strcspn(auth + 5, " ");
+        if (len >= sizeof(path)) {
+            return false;
+        }
+
+        memcpy(path, auth + 5, len);
+        path[len] = '\0';
+        int32_t fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            CF_WRN_LOG("Warning: Could not open jobserver fifo \"%s\", ignoring it\n", path);
+            return false;
+        }
+
+        cf_jobserver.rfd = fd;
+        cf_jobserver.wfd = fd;
+        return true;
+    }
+
+    int rfd = -1;
+    int wfd = -1;
+    if (sscanf(auth, "%d,%d", &rfd, &wfd) != 2 || rfd < 0 || wfd < 0) {
+        return false;
+    }
+
+    /* make only passes the fds down to recipes it knows are submakes */
+    if (fcntl(rfd, F_GETFD) < 0 || fcntl(wfd, F_GETFD) < 0) {
+        CF_WRN_LOG("Warning: Jobserver file descriptors are not available, ignoring jobserver\n");
+        return false;
+    }
+
+    cf_jobserver.rfd = rfd;
+    cf_jobserver.wfd = wfd;
+    return true;
+}
+
+static void cf_jobserver_serve(size_t jobs) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        CF_WRN_LOG("Warning: pipe() failed, not serving a jobserver\n");
+        return;
+    }
+
+    for (size_t i = 1; i < jobs; i++) {
+        if (write(fds[1], "+", 1) != 1) {
+            CF_WRN_LOG("Warning: Could not fill jobserver, not serving a jobserver\n");
+            close(fds[0]);
+            close(fds[1]);
+            return;
+        }
+    }
+
+    const char* old = getenv("MAKEFLAGS");
+    char makeflags[CF_MAX_MAKEFLAGS_LENGTH];
+    int n = snprintf(
+        makeflags,
+        sizeof(makeflags),
+        "%s -j%zu --jobserver-auth=%d,%d --jobserver-fds=%d,%d",
+        (old != NULL) ? old : "",
+        jobs, fds[0], fds[1], fds[0], fds[1]
+    );
+    if (n < 0 || (size_t) n >= sizeof(makeflags) || setenv("MAKEFLAGS", makeflags, 1) != 0) {
+        CF_WRN_LOG("Warning: Could not export MAKEFLAGS, not serving a jobserver\n");
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+
+    cf_jobserver.rfd = fds[0];
+    cf_jobserver.wfd = fds[1];
+}
+
+static void cf_jobserver_setup(size_t jobs) {
+    const char* makeflags = getenv("MAKEFLAGS");
+    cf_jobserver.rfd = -1;
+    cf_jobserver.wfd = -1;
+    if (makeflags == NULL || !cf_jobserver_join(makeflags)) {
+        cf_jobserver_serve(jobs);
+    }
+
+    if (cf_jobserver.rfd < 0) {
+        return;
+    }
+
+    if (mtx_init(&cf_jobserver.lock, mtx_plain) != thrd_success || cnd_init(&cf_jobserver.turn) != thrd_success) {
+        CF_ERR_LOG("Error: mtx_init() failed in cf_jobserver_setup()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    /*
+     * O_NONBLOCK on rfd itself would leak into the children sharing it, a
+     * fresh open of the same pipe gets a file description of its own.
+     */
+    char self_fd[64];
+    snprintf(self_fd, sizeof(self_fd), "/proc/self/fd/%d", (int) cf_jobserver.rfd);
+    cf_jobserver.poll_fd = open(self_fd, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (cf_jobserver.poll_fd < 0) {
+        cf_jobserver.poll_fd = cf_jobserver.rfd;
+    }
+
+    int wake[2];
+    if (pipe(wake) != 0) {
+        CF_ERR_LOG("Error: pipe() failed in cf_jobserver_setup()\n");
+        exit(CF_OS_FAIL_EC);
+    }
+
+    for (size_t i = 0; i < 2; i++) {
+        fcntl(wake[i], F_SETFD, FD_CLOEXEC);
+        fcntl(wake[i], F_SETFL, O_NONBLOCK);
+        cf_jobserver.wake[i] = wake[i];
+    }
+
+    cf_jobserver.implicit_free = true;
+    cf_jobserver.active = true;
+}
+
+/* Returns the token byte to hand back, or -1 for the implicit token */
+static int32_t cf_jobserver_acquire(void) {
+    if (!cf_jobserver.active) {
+        return -1;
+    }
+
+    mtx_lock(&cf_jobserver.lock);
+    while (!cf_jobserver.implicit_free && cf_jobserver.polling) {
+        cnd_wait(&cf_jobserver.turn, &cf_jobserver.lock);
+    }
+
+    if (cf_jobserver.implicit_free) {
+        cf_jobserver.implicit_free = false;
+        mtx_unlock(&cf_jobserver.lock);
+        return -1;
+    }
+    cf_jobserver.polling = true;
+    mtx_unlock(&cf_jobserver.lock);
+
+    int32_t token = -1;
+    while (true) {
+        struct pollfd pfds[2] = {
+            { .fd = cf_jobserver.poll_fd, .events = POLLIN, .revents = 0 },
+            { .fd = cf_jobserver.wake[0], .events = POLLIN, .revents = 0 },
+        };
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+
+            CF_ERR_LOG("Error: poll() on the jobserver failed: %s\n", strerror(errno));
+            exit(CF_OS_FAIL_EC);
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            unsigned char byte;
+            while (read(cf_jobserver.wake[0], &byte, 1) == 1) {}
+
+            mtx_lock(&cf_jobserver.lock);
+            bool taken = cf_jobserver.implicit_free;
+            cf_jobserver.implicit_free = false;
+            mtx_unlock(&cf_jobserver.lock);
+            if (taken) {
+                break;
+            }
+        }
+
+        if (pfds[0].revents == 0) {
+            continue;
+        }
+
+        /* Another reader may have taken the byte, poll_fd returns EAGAIN then */
+        unsigned char byte;
+        ssize_t n = read(cf_jobserver.poll_fd, &byte, 1);
+        if (n == 1) {
+            token = byte;
+            break;
+        }
+
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+
+        CF_ERR_LOG("Error: Reading from the jobserver failed\n");
+        exit(CF_OS_FAIL_EC);
+    }
+
+    mtx_lock(&cf_jobserver.lock);
+    cf_jobserver.polling = false;
+    cnd_signal(&cf_jobserver.turn);
+    if (token >= 0 && cf_jobserver.closed) {
+        /* Held tokens were handed back at exit already, so is this one */
+        unsigned char byte = (unsigned char) token;
+        mtx_unlock(&cf_jobserver.lock);
+        while (write(cf_jobserver.wfd, &byte, 1) != 1 && errno == EINTR) {
+        }
+        return -1;
+    }
+
+    if (token >= 0) {
+        if (cf_jobserver.num_held >= cf_jobserver.held_cap) {
+            size_t ncap = (cf_jobserver.held_cap == 0) ? CF_INIT_THRDS : cf_jobserver.held_cap * 2;
+            unsigned char* nheld = (unsigned char*) realloc(cf_jobserver.held, ncap);
+            if (nheld == NULL) {
+                mtx_unlock(&cf_jobserver.lock);
+                CF_ERR_LOG("Error: realloc() failed in cf_jobserver_acquire()\n");
+                exit(CF_CLIB_FAIL_EC);
+            }
+
+            cf_jobserver.held = nheld;
+            cf_jobserver.held_cap = ncap;
+        }
+        cf_jobserver.held[cf_jobserver.num_held++] = (unsigned char) token;
+    }
+    mtx_unlock(&cf_jobserver.lock);
+    return token;
+}
+
+static void cf_jobserver_release(int32_t token) {
+    if (!cf_jobserver.active) {
+        return;
+    }
+
+    if (token < 0) {
+        mtx_lock(&cf_jobserver.lock);
+        cf_jobserver.implicit_free = true;
+        bool wake = cf_jobserver.polling;
+        cnd_signal(&cf_jobserver.turn);
+        mtx_unlock(&cf_jobserver.lock);
+
+        /* A full wake pipe already has a wakeup pending */
+        if (wake && write(cf_jobserver.wake[1], "+", 1) != 1 && errno != EAGAIN) {
+            CF_WRN_LOG("Warning: Could not wake a jobserver waiter\n");
+        }
+        return;
+    }
+
+    mtx_lock(&cf_jobserver.lock);
+    bool held = false;
+    for (size_t i = cf_jobserver.num_held; i > 0 && !cf_jobserver.closed; i--) {
+        if (cf_jobserver.held[i - 1] == (unsigned char) token) {
+            cf_jobserver.held[i - 1] = cf_jobserver.held[--cf_jobserver.num_held];
+            held = true;
+            break;
+        }
+    }
+    mtx_unlock(&cf_jobserver.lock);
+
+    /* Not held anymore means it was returned at exit */
+    if (!held) {
+        return;
+    }
+
+    unsigned char byte = (unsigned char) token;
+    while (write(cf_jobserver.wfd, &byte, 1) != 1) {
+        if (errno != EINTR) {
+            CF_WRN_LOG("Warning: Could not return a jobserver token\n");
+            return;
+        }
+    }
+}
+
+/*
+ * Writes back the tokens of commands still running, so an exit or abort
+ * never takes slots away from the jobserver of a parent make.
+ */
+static void cf_jobserver_return_held(void) {
+    if (!cf_jobserver.active) {
+        return;
+    }
+
+    mtx_lock(&cf_jobserver.lock);
+    cf_jobserver.closed = true;
+    unsigned char* held = cf_jobserver.held;
+    size_t num_held = cf_jobserver.num_held;
+    cf_jobserver.held = NULL;
+    cf_jobserver.num_held = 0;
+    cf_jobserver.held_cap = 0;
+    mtx_unlock(&cf_jobserver.lock);
+
+    for (size_t i = 0; i < num_held; i++) {
+        while (write(cf_jobserver.wfd, &held[i], 1) != 1 && errno == EINTR) {
+        }
+    }
+    free(held);
+}
+#else
+static inline void cf_jobserver_setup(size_t jobs) {
+    (void) jobs;
+}
+
+static inline int32_t cf_jobserver_acquire(void) {
+    return -1;
+}
+
+static inline void cf_jobserver_release(int32_t token) {
+    (void) token;
+}
+
+static inline void cf_jobserver_return_held(void) {
+}
+#endif // CF_DISABLE_JOBSERVER
+
+static bool cf_run_command_token(const char* command, char* const* envp, bool parallel) {
+    int32_t token = cf_jobserver_acquire();
+    bool ok = cf_run_command(command, envp, parallel);
+    cf_jobserver_release(token);
+    return ok;
+}
+
+/*
+ * Streams a file through one wide-lane hash state per seed (at most two)
+ * in a single read pass.
+ */
+__attribute__((unused)) static bool cf_hash_file_seeds(const char* path, const uint64_t* seeds, uint64_t* hashes, size_t count) {
+    int32_t fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    /* Let readahead run ahead of the hash loop, memory use stays constant */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint8_t buf[CF_HASH_READ_SZ];
+    cf_wh_state_t states[2];
+    for (size_t i = 0; i < count; i++) {
+        cf_wh_init(&states[i], seeds[i]);
+    }
+
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            close(fd);
+            return false;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            cf_wh_update(&states[i], buf, (size_t) n);
+        }
+    }
+
+    close(fd);
+    for (size_t i = 0; i < count; i++) {
+        hashes[i] = cf_wh_digest(&states[i]);
+    }
+    return true;
+}
+
+#ifndef CF_DISABLE_ACTION_CACHE
+/*
+ * Action cache. A record in CF_CACHE_DIR/ac, named after the hash of the
+ * command line, the env hash and the contents of the declared inputs, lists
+ * the content hashes of the declared outputs. Output contents live in the
+ * content-addressed store CF_CACHE_DIR/cas, which is trimmed by atime (LRU)
+ * at exit. The atime is set explicitly on use, so noatime mounts work too,
+ * and the mtime of a blob never changes under a hardlinked output.
+ */
+static const uint64_t cf_cache_seeds[2] = { 0, CF_CACHE_SEED };
+
+/* Bytes added to the store during this run, guarded by global_workq->lock */
+static uint64_t cf_cache_stored = 0;
+static uint64_t cf_cache_tmp_seq = 0;
+
+static void cf_cache_absorb(cf_wh_state_t* states, const void* data, size_t len) {
+    for (size_t i = 0; i < 2; i++) {
+        cf_wh_update(&states[i], (const uint8_t*) data, len);
+    }
+}
+
+static void cf_cache_hex(const uint64_t* hash, char* out) {
+    snprintf(out, 33, "%016llx%016llx", (unsigned long long) hash[0], (unsigned long long) hash[1]);
+}
+
+static bool cf_cache_touch(const char* path) {
+    struct timespec times[2] = { { .tv_sec = 0, .tv_nsec = UTIME_NOW }, { .tv_sec = 0, .tv_nsec = UTIME_OMIT } };
+    return utimensat(AT_FDCWD, path, times, 0) == 0;
+}
+
+static void cf_cache_tmp_path(char* out, size_t size) {
+    mtx_lock(&global_workq->lock);
+    unsigned long long seq = ++cf_cache_tmp_seq;
+    mtx_unlock(&global_workq->lock);
+
+    snprintf(out, size, CF_CACHE_DIR "/tmp.%ld.%llu", (long) getpid(), seq);
+}
+
+/*
+ * Creates dst as a copy of src. Extents are shared (reflink) where the
+ * filesystem supports it; without copy set, only a reflink is attempted.
+ */
+static bool cf_cache_clone(const char* src, const char* dst, mode_t mode, bool copy) {
+    int32_t in = open(src, O_RDONLY);
+    if (in < 0) {
+        return false;
+    }
+
+    int32_t out = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+
+    bool ok = false;
+#if defined(__linux__) || defined(linux)
+    ok = ioctl(out, _IOW(0x94, 9, int), in) == 0;
+#endif
+    if (!ok && copy) {
+        uint8_t buf[CF_HASH_READ_SZ];
+        ssize_t n;
+        while ((n = read(in, buf, sizeof(buf))) != 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (n < 0 || write(out, buf, (size_t) n) != n) {
+                break;
+            }
+        }
+        ok = (n == 0);
+    }
+
+    ok = fchmod(out, mode & 0777) == 0 && ok;
+    close(in);
+    if (close(out) != 0 || !ok) {
+        unlink(dst);
+        return false;
+    }
+
+    return true;
+}
+
+/* Remote backend, set up once in main() before any job runs */
+static const cf_cache_backend_t* cf_remote = NULL;
+static void* cf_remote_ctx = NULL;
+/* Set on the first backend failure, guarded by global_workq->lock */
+static bool cf_remote_down = false;
+
+typedef struct {
+    char name[40];
+    char path[64];
+    char tmp[64];
+    mode_t mode;
+    bool found;
+} cf_cache_object_t;
+
+typedef struct {
+    char host[256];
+    char port[8];
+    char prefix[512];
+    mtx_t lock;
+    int32_t idle[CF_MAX_REMOTE_CONNS];
+    size_t num_idle;
+} cf_http_cache_t;
+
+typedef struct {
+    int32_t fd;
+    bool reused;
+    size_t pos;
+    size_t len;
+    size_t out_len;
+    char buf[CF_HASH_READ_SZ];
+    char out[CF_HTTP_OUT_SZ];
+} cf_http_conn_t;
+
+static bool cf_http_parse_url(const char* url, cf_http_cache_t* http) {
+    if (strncmp(url, "http://", 7) != 0) {
+        return false;
+    }
+
+    const char* host = url + 7;
+    size_t host_len = strcspn(host, ":/");
+    if (host_len == 0 || host_len >= sizeof(http->host)) {
+        return false;
+    }
+    memcpy(http->host, host, host_len);
+    http->host[host_len] = '\0';
+
+    const char* rest = host + host_len;
+    snprintf(http->port, sizeof(http->port), "80");
+    if (*rest == ':') {
+        size_t port_len = strspn(++rest, "0123456789");
+        if (port_len == 0 || port_len >= sizeof(http->port)) {
+            return false;
+        }
+        memcpy(http->port, rest, port_len);
+        http->port[port_len] = '\0';
+        rest += port_len;
+    }
+
+    if (*rest != '\0' && *rest != '/') {
+        return false;
+    }
+
+    size_t prefix_len = strlen(rest);
+    while (prefix_len > 0 && rest[prefix_len - 1] == '/') {
+        prefix_len--;
+    }
+    if (prefix_len >= sizeof(http->prefix)) {
+        return false;
+    }
+    memcpy(http->prefix, rest, prefix_len);
+    http->prefix[prefix_len] = '\0';
+
+    return true;
+}
+
+static int32_t cf_http_connect(cf_http_cache_t* http) {
+    struct addrinfo hints = { 0 };
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* addrs = NULL;
+    if (getaddrinfo(http->host, http->port, &hints, &addrs) != 0) {
+        return -1;
+    }
+
+    int32_t fd = -1;
+    for (struct addrinfo* ai = addrs; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        struct timeval timeout = { .tv_sec = CF_REMOTE_TIMEOUT_S, .tv_usec = 0 };
+        int32_t one = 1;
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        /* Requests are flushed whole, don't hold back the last segment */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+
+    return fd;
+}
+
+/* Takes a kept-alive connection from the pool unless a fresh one is asked for */
+static bool cf_http_open(cf_http_cache_t* http, cf_http_conn_t* conn, bool fresh) {
+    conn->fd = -1;
+    conn->reused = false;
+    conn->pos = 0;
+    conn->len = 0;
+    conn->out_len = 0;
+
+    mtx_lock(&http->lock);
+    if (!fresh && http->num_idle > 0) {
+        conn->fd = http->idle[--http->num_idle];
+        conn->reused = true;
+    }
+    mtx_unlock(&http->lock);
+
+    if (conn->fd < 0) {
+        conn->fd = cf_http_connect(http);
+    }
+
+    return conn->fd >= 0;
+}
+
+static void cf_http_close(cf_http_cache_t* http, cf_http_conn_t* conn, bool keep) {
+    if (conn->fd < 0) {
+        return;
+    }
+
+    /* Leftover input means the responses are out of step with the requests */
+    if (keep && conn->pos == conn->len) {
+        mtx_lock(&http->lock);
+        if (http->num_idle < CF_MAX_REMOTE_CONNS) {
+            http->idle[http->num_idle++] = conn->fd;
+            conn->fd = -1;
+        }
+        mtx_unlock(&http->lock);
+    }
+
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+static bool cf_http_flush(cf_http_conn_t* conn) {
+    size_t off = 0;
+    while (off < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out + off, conn->out_len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return false;
+        }
+        off += (size_t) n;
+    }
+    conn->out_len = 0;
+
+    return true;
+}
+
+/* Buffers outgoing data so pipelined requests leave in as few segments as possible */
+static bool cf_http_queue(cf_http_conn_t* conn, const char* data, size_t len) {
+    while (len > 0) {
+        if (conn->out_len == sizeof(conn->out) && !cf_http_flush(conn)) {
+            return false;
+        }
+
+        size_t n = sizeof(conn->out) - conn->out_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(conn->out + conn->out_len, data, n);
+        conn->out_len += n;
+        data += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool cf_http_fill(cf_http_conn_t* conn) {
+    ssize_t n;
+    do {
+        n = recv(conn->fd, conn->buf, sizeof(conn->buf), 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        return false;
+    }
+    conn->pos = 0;
+    conn->len = (size_t) n;
+
+    return true;
+}
+
+static bool cf_http_read_line(cf_http_conn_t* conn, char* line, size_t size) {
+    size_t len = 0;
+    for (;;) {
+        if (conn->pos == conn->len && !cf_http_fill(conn)) {
+            return false;
+        }
+
+        char c = conn->buf[conn->pos++];
+        if (c == '\n') {
+            break;
+        }
+
+        if (len + 1 >= size) {
+            return false;
+        }
+        line[len++] = c;
+    }
+
+    if (len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
+    line[len] = '\0';
+
+    return true;
+}
+
+/* Reads a response head, returns the status code or -1 if the connection is unusable */
+static int32_t cf_http_read_head(cf_http_conn_t* conn, uint64_t* length, bool* keep) {
+    char line[1024];
+    int32_t status = 0;
+    int32_t minor = 0;
+    if (!cf_http_read_line(conn, line, sizeof(line)) || sscanf(line, "HTTP/1.%d %d", &minor, &status) != 2) {
+        return -1;
+    }
+
+    bool has_length = false;
+    *keep = (minor > 0);
+    while (cf_http_read_line(conn, line, sizeof(line))) {
+        if (line[0] == '\0') {
+            /* Only length-delimited bodies keep a pipeline in step */
+            if (!has_length) {
+                *length = 0;
+                return (status == 204 || status == 304) ? status : -1;
+            }
+
+            return status;
+        }
+
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            char* end = NULL;
+            *length = strtoull(line + 15, &end, 10);
+            has_length = (end != line + 15);
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            *keep = (strstr(line + 11, "close") == NULL);
+        }
+    }
+
+    return -1;
+}
+
+/* Reads a body into out, or discards it if out is -1. Write errors only clear *stored */
+static bool cf_http_read_body(cf_http_conn_t* conn, uint64_t length, int32_t out, bool* stored) {
+    while (length > 0) {
+        if (conn->pos == conn->len && !cf_http_fill(conn)) {
+            return false;
+        }
+
+        size_t n = conn->len - conn->pos;
+        if (n > length) {
+            n = (size_t) length;
+        }
+
+        if (out >= 0 && *stored && write(out, conn->buf + conn->pos, n) != (ssize_t) n) {
+            *stored = false;
+        }
+        conn->pos += n;
+        length -= n;
+    }
+
+    return true;
+}
+
+/* Sends one GET per object before reading any response */
+static bool cf_http_fetch(void* ctx, const char* const* names, const char* const* paths, bool* found, size_t count) {
+    cf_http_cache_t* http = (cf_http_cache_t*) ctx;
+    cf_http_conn_t conn;
+
+    for (size_t attempt = 0; attempt < 2; attempt++) {
+        if (!cf_http_open(http, &conn, attempt > 0)) {
+            return false;
+        }
+
+        bool ok = true;
+        for (size_t i = 0; i < count && ok; i++) {
+            char request[1024];
+            int32_t len = snprintf(request, sizeof(request), "GET %s/%s HTTP/1.1\r\nHost: %s\r\n\r\n", http->prefix, names[i], http->host);
+            ok = len > 0 && (size_t) len < sizeof(request) && cf_http_queue(&conn, request, (size_t) len);
+        }
+        ok = ok && cf_http_flush(&conn);
+
+        bool keep = true;
+        size_t answered = 0;
+        for (size_t i = 0; i < count && ok; i++) {
+            uint64_t length = 0;
+            int32_t status = cf_http_read_head(&conn, &length, &keep);
+            if (status == 200) {
+                int32_t out = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0600);
+                bool stored = (out >= 0);
+                ok = cf_http_read_body(&conn, length, out, &stored);
+                if (out >= 0) {
+                    stored = close(out) == 0 && stored && ok;
+                    if (!stored) {
+                        unlink(paths[i]);
+                    }
+                }
+                found[i] = stored;
+            } else if (status == 404) {
+                bool unused = false;
+                ok = cf_http_read_body(&conn, length, -1, &unused);
+            } else {
+                ok = false;
+            }
+
+            answered += ok;
+            ok = ok && (keep || i + 1 == count);
+        }
+        cf_http_close(http, &conn, ok && keep);
+
+        /* A kept-alive connection may have been closed by the server meanwhile */
+        if (ok || !conn.reused || answered > 0) {
+            return ok;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Sends one PUT per object before reading any response. While sending,
+ * stored[i] marks the objects that went out, so the responses can be
+ * matched to them.
+ */
+static bool cf_http_push(void* ctx, const char* const* names, const char* const* paths, bool* stored, size_t count) {
+    cf_http_cache_t* http = (cf_http_cache_t*) ctx;
+    cf_http_conn_t conn;
+
+    for (size_t attempt = 0; attempt < 2; attempt++) {
+        memset(stored, 0, count * sizeof(bool));
+        if (!cf_http_open(http, &conn, attempt > 0)) {
+            return false;
+        }
+
+        bool ok = true;
+        size_t sent = 0;
+        for (size_t i = 0; i < count && ok; i++) {
+            int32_t in = open(paths[i], O_RDONLY);
+            struct stat st;
+            if (in < 0 || fstat(in, &st) != 0) {
+                if (in >= 0) {
+                    close(in);
+                }
+                continue;
+            }
+
+            char request[1024];
+            int32_t len = snprintf(request, sizeof(request), "PUT %s/%s HTTP/1.1\r\nHost: %s\r\nContent-Length: %llu\r\n\r\n", http->prefix, names[i], http->host, (unsigned long long) st.st_size);
+            ok = len > 0 && (size_t) len < sizeof(request) && cf_http_queue(&conn, request, (size_t) len);
+
+            /* The body must match the announced length or the pipeline breaks */
+            uint64_t left = (uint64_t) st.st_size;
+            while (ok && left > 0) {
+                ssize_t n = read(in, conn.buf, sizeof(conn.buf) < left ? sizeof(conn.buf) : (size_t) left);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                ok = n > 0 && cf_http_queue(&conn, conn.buf, (size_t) n);
+                left -= (n > 0) ? (uint64_t) n : 0;
+            }
+            close(in);
+            stored[i] = true;
+            sent++;
+        }
+        ok = ok && cf_http_flush(&conn);
+
+        bool keep = true;
+        size_t answered = 0;
+        size_t next = 0;
+        for (size_t i = 0; i < sent && ok; i++) {
+            while (!stored[next]) {
+                next++;
+            }
+
+            uint64_t length = 0;
+            bool unused = false;
+            int32_t status = cf_http_read_head(&conn, &length, &keep);
+            ok = status >= 0 && cf_http_read_body(&conn, length, -1, &unused);
+            stored[next++] = ok && status >= 200 && status < 300;
+            answered += ok;
+            ok = ok && (keep || i + 1 == sent);
+        }
+        cf_http_close(http, &conn, ok && keep);
+
+        /* Objects whose response never came are not known to be stored */
+        for (; next < count; next++) {
+            stored[next] = false;
+        }
+
+        if (ok || !conn.reused || answered > 0) {
+            return ok;
+        }
+    }
+
+    return false;
+}
+
+static void cf_http_free(void* ctx) {
+    cf_http_cache_t* http = (cf_http_cache_t*) ctx;
+    for (size_t i = 0; i < http->num_idle; i++) {
+        close(http->idle[i]);
+    }
+    mtx_destroy(&http->lock);
+    free(http);
+}
+
+static const cf_cache_backend_t cf_http_backend = {
+    .fetch = cf_http_fetch,
+    .push = cf_http_push,
+    .close = cf_http_free,
+};
+
+static void cf_remote_setup(const char* url) {
+    cf_http_cache_t* http = (cf_http_cache_t*) calloc(1, sizeof(cf_http_cache_t));
+    if (http == NULL) {
+        CF_ERR_LOG("Error: calloc() failed in cf_remote_setup()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    if (!cf_http_parse_url(url, http)) {
+        CF_ERR_LOG("Error: Invalid remote cache URL \"%s\", expected http://host[:port][/prefix]!\n", url);
+        exit(CF_INVALID_ARG_EC);
+    }
+
+    mtx_init(&http->lock, mtx_plain);
+    cf_remote = &cf_http_backend;
+    cf_remote_ctx = http;
+}
+
+static bool cf_remote_usable(void) {
+    if (cf_remote == NULL) {
+        return false;
+    }
+
+    mtx_lock(&global_workq->lock);
+    bool usable = !cf_remote_down;
+    mtx_unlock(&global_workq->lock);
+
+    return usable;
+}
+
+/* A failing remote would cost a timeout per action, so it is dropped for the run */
+static void cf_remote_failed(void) {
+    mtx_lock(&global_workq->lock);
+    bool first = !cf_remote_down;
+    cf_remote_down = true;
+    mtx_unlock(&global_workq->lock);
+
+    if (first) {
+        CF_WRN_LOG("Warning: Remote cache failed, continuing with the local cache only\n");
+    }
+}
+
+static void cf_cache_object(cf_cache_object_t* object, const char* kind, const char* hex, mode_t mode) {
+    snprintf(object->name, sizeof(object->name), "%s/%s", kind, hex);
+    if (strcmp(kind, "cas") == 0) {
+        snprintf(object->path, sizeof(object->path), CF_CACHE_DIR "/cas/%.2s/%s", hex, hex + 2);
+    } else {
+        snprintf(object->path, sizeof(object->path), CF_CACHE_DIR "/%s/%s", kind, hex);
+    }
+    object->tmp[0] = '\0';
+    object->mode = mode;
+    object->found = false;
+}
+
+/*
+ * Fetches the objects that are missing locally from the remote in one batch
+ * and sets found for every object that is available afterwards. Blobs are
+ * checked against their name before they enter the store.
+ */
+static void cf_cache_pull(cf_cache_object_t* objects, size_t count) {
+    const char** names = (const char**) malloc(count * (2 * sizeof(const char*) + sizeof(size_t) + sizeof(bool)));
+    if (names == NULL) {
+        CF_ERR_LOG("Error: malloc() failed in cf_cache_pull()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+    const char** paths = names + count;
+    size_t* index = (size_t*) (paths + count);
+    bool* found = (bool*) (index + count);
+
+    size_t missing = 0;
+    for (size_t i = 0; i < count; i++) {
+        objects[i].found = access(objects[i].path, F_OK) == 0;
+        if (!objects[i].found) {
+            cf_cache_tmp_path(objects[i].tmp, sizeof(objects[i].tmp));
+            names[missing] = objects[i].name;
+            paths[missing] = objects[i].tmp;
+            index[missing++] = i;
+        }
+    }
+
+    if (missing == 0 || !cf_remote_usable()) {
+        free(names);
+        return;
+    }
+
+    mkdir(CF_CACHE_DIR, 0755);
+    mkdir(CF_CACHE_DIR "/ac", 0755);
+    mkdir(CF_CACHE_DIR "/cas", 0755);
+    memset(found, 0, missing * sizeof(bool));
+    if (!cf_remote->fetch(cf_remote_ctx, names, paths, found, missing)) {
+        cf_remote_failed();
+    }
+
+    uint64_t added = 0;
+    for (size_t i = 0; i < missing; i++) {
+        cf_cache_object_t* object = &objects[index[i]];
+        if (!found[i]) {
+            continue;
+        }
+
+        struct stat st;
+        bool blob = strncmp(object->name, "cas/", 4) == 0;
+        if (blob) {
+            uint64_t hash[2];
+            char hex[33] = { 0 };
+            char fan[sizeof(object->path)];
+            if (cf_hash_file_seeds(object->tmp, cf_cache_seeds, hash, 2)) {
+                cf_cache_hex(hash, hex);
+            }
+
+            snprintf(fan, sizeof(fan), CF_CACHE_DIR "/cas/%.2s", object->name + 4);
+            mkdir(fan, 0755);
+            if (strcmp(hex, object->name + 4) != 0 || chmod(object->tmp, object->mode & 0555) != 0) {
+                unlink(object->tmp);
+                continue;
+            }
+        }
+
+        if (stat(object->tmp, &st) != 0 || rename(object->tmp, object->path) != 0) {
+            unlink(object->tmp);
+            continue;
+        }
+        object->found = true;
+        added += blob ? (uint64_t) st.st_size : 0;
+    }
+    free(names);
+
+    mtx_lock(&global_workq->lock);
+    cf_cache_stored += added;
+    mtx_unlock(&global_workq->lock);
+}
+
+/* Objects of stored actions waiting for upload, each action's blobs before its record */
+static cf_cache_object_t* cf_push_queue = NULL;
+static size_t cf_push_len = 0;
+static size_t cf_push_cap = 0;
+
+/*
+ * Uploads the queued objects in two batches: all blobs first, then the
+ * records whose blobs were all accepted, so the remote never serves a
+ * record that lacks a blob.
+ */
+static void cf_cache_flush_pushes(void) {
+    mtx_lock(&global_workq->lock);
+    cf_cache_object_t* objects = cf_push_queue;
+    size_t count = cf_push_len;
+    cf_push_queue = NULL;
+    cf_push_len = 0;
+    cf_push_cap = 0;
+    mtx_unlock(&global_workq->lock);
+
+    if (count == 0 || !cf_remote_usable()) {
+        free(objects);
+        return;
+    }
+
+    const char** names = (const char**) malloc(count * (2 * sizeof(const char*) + sizeof(bool)));
+    if (names == NULL) {
+        CF_ERR_LOG("Error: malloc() failed in cf_cache_flush_pushes()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+    const char** paths = names + count;
+    bool* stored = (bool*) (paths + count);
+
+    size_t num_blobs = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(objects[i].name, "cas/", 4) == 0) {
+            names[num_blobs] = objects[i].name;
+            paths[num_blobs++] = objects[i].path;
+        }
+    }
+
+    bool ok = cf_remote->push(cf_remote_ctx, names, paths, stored, num_blobs);
+
+    /* Blobs keep their order in names, so stored[blob] follows objects */
+    size_t num_records = 0;
+    size_t blob = 0;
+    bool complete = true;
+    for (size_t i = 0; i < count && ok; i++) {
+        if (strncmp(objects[i].name, "cas/", 4) == 0) {
+            complete = complete && stored[blob++];
+            continue;
+        }
+
+        if (complete) {
+            names[num_records] = objects[i].name;
+            paths[num_records++] = objects[i].path;
+        }
+        complete = true;
+    }
+
+    ok = ok && (num_records == 0 || cf_remote->push(cf_remote_ctx, names, paths, stored, num_records));
+    if (!ok) {
+        cf_remote_failed();
+    }
+    free(names);
+    free(objects);
+}
+
+/* Queues a stored action for upload, flushing once a batch is full */
+static void cf_cache_push(const cf_cache_object_t* objects, size_t count) {
+    mtx_lock(&global_workq->lock);
+    if (cf_push_len + count > cf_push_cap) {
+        size_t ncap = (cf_push_cap == 0) ? CF_REMOTE_BATCH : cf_push_cap;
+        while (ncap < cf_push_len + count) {
+            ncap *= 2;
+        }
+
+        cf_cache_object_t* nqueue = (cf_cache_object_t*) realloc(cf_push_queue, ncap * sizeof(cf_cache_object_t));
+        if (nqueue == NULL) {
+            mtx_unlock(&global_workq->lock);
+            CF_ERR_LOG("Error: realloc() failed in cf_cache_push()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+
+        cf_push_queue = nqueue;
+        cf_push_cap = ncap;
+    }
+    memcpy(cf_push_queue + cf_push_len, objects, count * sizeof(cf_cache_object_t));
+    cf_push_len += count;
+    bool full = (cf_push_len >= CF_REMOTE_BATCH);
+    mtx_unlock(&global_workq->lock);
+
+    if (full) {
+        cf_cache_flush_pushes();
+    }
+}
+
+/* Uploads what is still queued, then closes the backend */
+static void cf_remote_teardown(void) {
+    if (cf_remote != NULL) {
+        cf_cache_flush_pushes();
+        cf_remote->close(cf_remote_ctx);
+        cf_remote = NULL;
+        cf_remote_ctx = NULL;
+    }
+}
+
+static bool cf_cache_key(const char* command, cf_action_t* action) {
+    cf_wh_state_t states[2];
+    for (size_t i = 0; i < 2; i++) {
+        cf_wh_init(&states[i], cf_cache_seeds[i]);
+    }
+
+    cf_cache_absorb(states, command, strlen(command) + 1);
+    cf_cache_absorb(states, &action->env_hash, sizeof(action->env_hash));
+    for (size_t i = 0; i < action->num_inputs; i++) {
+        uint64_t hash[2];
+        if (!cf_hash_file_seeds(action->inputs[i], cf_cache_seeds, hash, 2)) {
+            return false;
+        }
+
+        cf_cache_absorb(states, action->inputs[i], strlen(action->inputs[i]) + 1);
+        cf_cache_absorb(states, hash, sizeof(hash));
+    }
+
+    for (size_t i = 0; i < action->num_outputs; i++) {
+        cf_cache_absorb(states, action->outputs[i], strlen(action->outputs[i]) + 1);
+    }
+
+    for (size_t i = 0; i < 2; i++) {
+        action->key[i] = cf_wh_digest(&states[i]);
+    }
+    return true;
+}
+
+/*
+ * Reflinks or copies the blob to output, hardlinks it only with
+ * CF_CACHE_HARDLINKS. The result is checked against the blob's name, so a
+ * corrupted blob is dropped instead of restored.
+ */
+static bool cf_cache_place(const cf_cache_object_t* blob, const char* output) {
+    if (unlink(output) != 0 && errno != ENOENT) {
+        return false;
+    }
+
+    bool placed = cf_cache_clone(blob->path, output, blob->mode, false);
+#ifdef CF_CACHE_HARDLINKS
+    placed = placed || link(blob->path, output) == 0;
+#endif
+    placed = placed || cf_cache_clone(blob->path, output, blob->mode, true);
+    if (!placed) {
+        return false;
+    }
+
+    uint64_t hash[2];
+    char hex[33] = { 0 };
+    if (cf_hash_file_seeds(output, cf_cache_seeds, hash, 2)) {
+        cf_cache_hex(hash, hex);
+    }
+
+    if (strcmp(hex, blob->name + 4) != 0) {
+        unlink(output);
+        unlink(blob->path);
+        return false;
+    }
+
+    cf_cache_touch(blob->path);
+    return true;
+}
+
+/* Reads the blobs a record lists, false unless it names exactly the outputs of action */
+static bool cf_cache_read_record(const char* path, const cf_action_t* action, cf_cache_object_t* blobs) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        return false;
+    }
+
+    bool hit = true;
+    char line[PATH_MAX + 64];
+    for (size_t i = 0; i < action->num_outputs && hit; i++) {
+        char blob_hex[33];
+        unsigned mode = 0;
+        int off = 0;
+        if (fgets(line, sizeof(line), fp) == NULL || sscanf(line, "%32s %o %n", blob_hex, &mode, &off) != 2 || strspn(blob_hex, "0123456789abcdef") != 32) {
+            hit = false;
+            break;
+        }
+
+        line[strcspn(line, "\n")] = '\0';
+        hit = strcmp(line + off, action->outputs[i]) == 0;
+        cf_cache_object(&blobs[i], "cas", blob_hex, (mode_t) mode);
+    }
+    fclose(fp);
+
+    return hit;
+}
+
+/* Claims a queued job for a batched lookup, called with global_workq->lock held */
+static bool cf_cache_claim(const cf_thrd_job* job, cf_action_t** actions, char** commands, size_t* count) {
+    if (job->action == NULL || job->command == NULL || job->action->prefetched || job->action->prefetching) {
+        return true;
+    }
+
+    /* The command may be freed by a worker draining a failed build, the action is not */
+    char* command = strdup(job->command);
+    if (command == NULL) {
+        return false;
+    }
+
+    job->action->prefetching = true;
+    actions[*count] = job->action;
+    commands[(*count)++] = command;
+    return true;
+}
+
+/*
+ * Looks up the remote for self and the cached jobs still queued behind it
+ * in one go: first all of their records, then all blobs those list, each
+ * batch pipelined on one connection. A build thus pays two round trips per
+ * batch, not per action. Workers picking a claimed job wait for the batch.
+ */
+static void cf_cache_prefetch(const char* command, cf_action_t* self) {
+    cf_action_t* actions[CF_REMOTE_BATCH];
+    char* commands[CF_REMOTE_BATCH];
+    size_t count = 1;
+    actions[0] = self;
+    commands[0] = NULL;
+
+    mtx_lock(&global_workq->lock);
+    bool ok = true;
+    for (int32_t i = global_workq->front; ok && i != global_workq->back && count < CF_REMOTE_BATCH; i = (i + 1) % CF_MAX_JOBS) {
+        ok = cf_cache_claim(&global_workq->jobs[i], actions, commands, &count);
+    }
+
+    for (cf_job_node_t* node = global_workq->ready_head; ok && node != NULL && count < CF_REMOTE_BATCH; node = node->next_ready) {
+        ok = cf_cache_claim(&node->job, actions, commands, &count);
+    }
+    mtx_unlock(&global_workq->lock);
+
+    size_t num_outputs = 0;
+    for (size_t i = 0; i < count; i++) {
+        num_outputs += actions[i]->num_outputs;
+    }
+
+    cf_cache_object_t* records = (cf_cache_object_t*) malloc((count + num_outputs) * sizeof(cf_cache_object_t));
+    if (records == NULL) {
+        CF_ERR_LOG("Error: malloc() failed in cf_cache_prefetch()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+    cf_cache_object_t* blobs = records + count;
+
+    size_t index[CF_REMOTE_BATCH];
+    size_t num_records = 0;
+    for (size_t i = 0; i < count; i++) {
+        char hex[33];
+        actions[i]->keyed = cf_cache_key((i == 0) ? command : commands[i], actions[i]);
+        if (actions[i]->keyed) {
+            cf_cache_hex(actions[i]->key, hex);
+            cf_cache_object(&records[num_records], "ac", hex, 0);
+            index[num_records++] = i;
+        }
+    }
+    cf_cache_pull(records, num_records);
+
+    size_t num_blobs = 0;
+    for (size_t i = 0; i < num_records; i++) {
+        cf_action_t* action = actions[index[i]];
+        if (records[i].found && cf_cache_read_record(records[i].path, action, blobs + num_blobs)) {
+            num_blobs += action->num_outputs;
+        }
+    }
+    cf_cache_pull(blobs, num_blobs);
+    free(records);
+
+    mtx_lock(&global_workq->lock);
+    for (size_t i = 0; i < count; i++) {
+        actions[i]->prefetching = false;
+        actions[i]->prefetched = true;
+        free(commands[i]);
+    }
+    cnd_broadcast(&global_workq->prefetched);
+    mtx_unlock(&global_workq->lock);
+}
+
+static bool cf_cache_restore(const char* command, cf_action_t* action) {
+    /* A batch started by another job may have keyed this one already */
+    if (!action->prefetched && cf_remote_usable()) {
+        cf_cache_prefetch(command, action);
+    } else if (!action->prefetched) {
+        action->keyed = cf_cache_key(command, action);
+    }
+
+    if (!action->keyed) {
+        return false;
+    }
+
+    char hex[33];
+    cf_cache_object_t record;
+    cf_cache_hex(action->key, hex);
+    cf_cache_object(&record, "ac", hex, 0);
+
+    cf_cache_object_t* blobs = (cf_cache_object_t*) malloc(action->num_outputs * sizeof(cf_cache_object_t));
+    if (blobs == NULL) {
+        CF_ERR_LOG("Error: malloc() failed in cf_cache_restore()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    bool hit = cf_cache_read_record(record.path, action, blobs);
+    for (size_t i = 0; i < action->num_outputs && hit; i++) {
+        hit = cf_cache_place(&blobs[i], action->outputs[i]);
+    }
+    free(blobs);
+
+    /* Blobs may have been evicted, the record is useless then */
+    if (!hit) {
+        unlink(record.path);
+        return false;
+    }
+
+    cf_cache_touch(record.path);
+    return true;
+}
+
+static void cf_cache_store(cf_action_t* action) {
+    if (!action->keyed) {
+        return;
+    }
+
+    mkdir(CF_CACHE_DIR, 0755);
+    mkdir(CF_CACHE_DIR "/ac", 0755);
+    mkdir(CF_CACHE_DIR "/cas", 0755);
+
+    char tmp_record[PATH_MAX];
+    cf_cache_tmp_path(tmp_record, sizeof(tmp_record));
+    FILE* fp = fopen(tmp_record, "w");
+    if (fp == NULL) {
+        return;
+    }
+
+    /* Blobs and then the record, in the order they are pushed */
+    cf_cache_object_t* objects = NULL;
+    if (cf_remote_usable()) {
+        objects = (cf_cache_object_t*) malloc((action->num_outputs + 1) * sizeof(cf_cache_object_t));
+        if (objects == NULL) {
+            CF_ERR_LOG("Error: malloc() failed in cf_cache_store()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+    }
+
+    bool ok = true;
+    uint64_t added = 0;
+    for (size_t i = 0; i < action->num_outputs && ok; i++) {
+        const char* output = action->outputs[i];
+        struct stat st;
+        uint64_t hash[2];
+        if (stat(output, &st) != 0 || !S_ISREG(st.st_mode) || !cf_hash_file_seeds(output, cf_cache_seeds, hash, 2)) {
+            ok = false;
+            break;
+        }
+
+        char hex[33];
+        char blob[PATH_MAX];
+        cf_cache_hex(hash, hex);
+        snprintf(blob, sizeof(blob), CF_CACHE_DIR "/cas/%.2s", hex);
+        mkdir(blob, 0755);
+        snprintf(blob, sizeof(blob), CF_CACHE_DIR "/cas/%.2s/%s", hex, hex + 2);
+
+        /* Blobs are read-only so hardlinked outputs can't be changed in place */
+        if (!cf_cache_touch(blob)) {
+            char tmp[PATH_MAX];
+            cf_cache_tmp_path(tmp, sizeof(tmp));
+            if (!cf_cache_clone(output, tmp, st.st_mode & 0555, true) || rename(tmp, blob) != 0) {
+                unlink(tmp);
+                ok = false;
+                break;
+            }
+            added += (uint64_t) st.st_size;
+        }
+
+        if (objects != NULL) {
+            cf_cache_object(&objects[i], "cas", hex, st.st_mode);
+        }
+        fprintf(fp, "%s %o %s\n", hex, (unsigned) (st.st_mode & 0777), output);
+    }
+
+    char hex[33];
+    char record[PATH_MAX];
+    cf_cache_hex(action->key, hex);
+    snprintf(record, sizeof(record), CF_CACHE_DIR "/ac/%s", hex);
+    if (fclose(fp) != 0 || !ok || rename(tmp_record, record) != 0) {
+        unlink(tmp_record);
+        free(objects);
+        return;
+    }
+
+    mtx_lock(&global_workq->lock);
+    cf_cache_stored += added;
+    mtx_unlock(&global_workq->lock);
+
+    if (objects != NULL) {
+        cf_cache_object(&objects[action->num_outputs], "ac", hex, 0);
+        cf_cache_push(objects, action->num_outputs + 1);
+        free(objects);
+    }
+}
+
+typedef struct {
+    char* path;
+    time_t atime;
+    uint64_t size;
+} cf_cache_blob_t;
+
+static int cf_cache_blob_cmp(const void* a, const void* b) {
+    time_t ta = ((const cf_cache_blob_t*) a)->atime;
+    time_t tb = ((const cf_cache_blob_t*) b)->atime;
+    return (ta > tb) - (ta < tb);
+}
+
+/* Evicts the least recently used blobs once the store outgrows CF_CACHE_MAX_SZ */
+static void cf_cache_trim(void) {
+    if (cf_cache_stored == 0) {
+        return;
+    }
+
+    DIR* cas = opendir(CF_CACHE_DIR "/cas");
+    if (cas == NULL) {
+        return;
+    }
+
+    cf_cache_blob_t* blobs = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    uint64_t total = 0;
+    struct dirent* fan;
+    while ((fan = readdir(cas)) != NULL) {
+        if (fan->d_name[0] == '.') {
+            continue;
+        }
+
+        char dir_path[PATH_MAX];
+        snprintf(dir_path, sizeof(dir_path), CF_CACHE_DIR "/cas/%s", fan->d_name);
+        DIR* dir = opendir(dir_path);
+        if (dir == NULL) {
+            continue;
+        }
+
+        struct dirent* ent;
+        while ((ent = readdir(dir)) != NULL) {
+            char path[PATH_MAX + 256];
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/%s", dir_path, ent->d_name);
+            if (ent->d_name[0] == '.' || stat(path, &st) != 0) {
+                continue;
+            }
+
+            if (count >= cap) {
+                cap = (cap == 0) ? 256 : cap * 2;
+                cf_cache_blob_t* nblobs = (cf_cache_blob_t*) realloc(blobs, cap * sizeof(cf_cache_blob_t));
+                if (nblobs == NULL) {
+                    CF_ERR_LOG("Error: realloc() failed in cf_cache_trim()\n");
+                    exit(CF_CLIB_FAIL_EC);
+                }
+                blobs = nblobs;
+            }
+
+            char* dup = strdup(path);
+            if (dup == NULL) {
+                CF_ERR_LOG("Error: strdup() failed in cf_cache_trim()\n");
+                exit(CF_CLIB_FAIL_EC);
+            }
+
+            blobs[count++] = (cf_cache_blob_t) {
+                .path = dup,
+                .atime = st.st_atime,
+                .size = (uint64_t) st.st_size,
+            };
+            total += (uint64_t) st.st_size;
+        }
+        closedir(dir);
+    }
+    closedir(cas);
+
+    /* Trim to 90% so that the next few stores don't trigger another scan */
+    if (total > CF_CACHE_MAX_SZ) {
+        qsort(blobs, count, sizeof(cf_cache_blob_t), cf_cache_blob_cmp);
+        for (size_t i = 0; i < count && total > CF_CACHE_MAX_SZ / 10 * 9; i++) {
+            if (unlink(blobs[i].path) == 0) {
+                total -= blobs[i].size;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        free(blobs[i].path);
+    }
+    free(blobs);
+}
+#else
+static inline bool cf_cache_restore(const char* command, cf_action_t* action) {
+    (void) command;
+    (void) action;
+    return false;
+}
+
+static inline void cf_cache_store(cf_action_t* action) {
+    (void) action;
+}
+
+static inline void cf_cache_trim(void) {}
+
+static inline void cf_remote_setup(const char* url) {
+    CF_WRN_LOG("Warning: Action cache is disabled, ignoring remote cache \"%s\"\n", url);
+}
+
+static inline void cf_remote_teardown(void) {}
+#endif // CF_DISABLE_ACTION_CACHE
+
+/*
+ * Runs a job's command, unless its declared outputs can be restored from the
+ * action cache. Only parallel jobs go through admission.
+ */
+static bool cf_run_job_command(const char* command, cf_action_t* action, char* const* envp, bool parallel) {
+    if (action != NULL) {
+        if (cf_cache_restore(command, action)) {
+            return true;
+        }
+    }
+
+    if (parallel) {
+        cf_admit_command();
+    }
+
+    bool ok = cf_run_command_token(command, envp, parallel);
+    if (parallel) {
+        cf_retire_command();
+    }
+
+    if (ok && action != NULL) {
+        cf_cache_store(action);
+    }
+
+    return ok;
+}
+
+/* Called with global_workq->lock held */
+static void cf_job_complete(cf_job_node_t* node) {
+    node->done = true;
+    for (size_t i = 0; i < node->num_dependents; i++) {
+        cf_job_node_t* dependent = node->dependents[i];
+        if (--dependent->waiting > 0 || dependent->failed) {
+            continue;
+        }
+
+        dependent->next_ready = NULL;
+        if (global_workq->ready_head == NULL) {
+            global_workq->ready_head = dependent;
+        } else {
+            global_workq->ready_tail->next_ready = dependent;
+        }
+        global_workq->ready_tail = dependent;
+        cnd_signal(&global_workq->new_job);
+    }
+}
+
+/* Called with global_workq->lock held */
+static void cf_job_add_dependent(cf_job_node_t* node, cf_job_node_t* dependent) {
+    if (node->num_dependents >= node->dependents_cap) {
+        size_t ncap = (node->dependents_cap == 0) ? 4 : node->dependents_cap * 2;
+        cf_job_node_t** ndeps = (cf_job_node_t**) realloc(node->dependents, ncap * sizeof(cf_job_node_t*));
+        if (ndeps == NULL) {
+            CF_ERR_LOG("Error: realloc() failed in cf_job_add_dependent()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+
+        node->dependents = ndeps;
+        node->dependents_cap = ncap;
+    }
+
+    node->dependents[node->num_dependents++] = dependent;
+    ++dependent->waiting;
+}
+
+/* Called with global_workq->lock held */
+static void cf_record_failure(const cf_target_decl_t* target, const char* command) {
+    if (cf_num_failures >= cf_failures_cap) {
+        size_t ncap = (cf_failures_cap == 0) ? 8 : cf_failures_cap * 2;
+        cf_failure_t* nfailures = (cf_failure_t*) realloc(cf_failures, ncap * sizeof(cf_failure_t));
+        if (nfailures == NULL) {
+            CF_ERR_LOG("Error: realloc() failed in cf_record_failure()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+
+        cf_failures = nfailures;
+        cf_failures_cap = ncap;
+    }
+
+    char* command_copy = strdup(command);
+    if (command_copy == NULL) {
+        CF_ERR_LOG("Error: strdup() failed in cf_record_failure()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    cf_failures[cf_num_failures++] = (cf_failure_t) {
+        .target = (target != NULL) ? target->name : NULL,
+        .command = command_copy,
+    };
+}
+
+/*
+ * Called with global_workq->lock held after node's command failed with -k.
+ * Jobs held for it are dropped with everything held for them in turn, so
+ * only work that depends on the failure stops. Their targets fail.
+ */
+static void cf_job_fail(cf_job_node_t* node) {
+    node->failed = true;
+    if (node->job.target != NULL) {
+        node->job.target->failed = true;
+    }
+
+    for (size_t i = 0; i < node->num_dependents; i++) {
+        cf_job_node_t* dependent = node->dependents[i];
+        if (dependent->failed) {
+            continue;
+        }
+
+        /* Never queued, so the accounting of cf_submit_job() is undone here */
+        cf_thrd_job* job = &dependent->job;
+        --global_workq->active_jobs;
+        if (job->target != NULL && --job->target->pending == 0) {
+            cnd_broadcast(&global_workq->target_done);
+        }
+
+        if (job->env != NULL && --job->env->refs == 0) {
+            free(job->env);
+        }
+        free(job->command);
+        free(job->action);
+        job->command = NULL;
+        job->action = NULL;
+        cf_job_fail(dependent);
+    }
+}
+
+/* Marks still held by a node belong to a job that failed or never ran */
+static void cf_free_job_nodes(cf_job_node_t* node) {
+    while (node != NULL) {
+        cf_job_node_t* next = node->next_owned;
+        for (size_t i = 0; i < node->num_marks; i++) {
+            free(node->marks[i].path);
+            free(node->marks[i].arg);
+            free(node->marks[i].action);
+        }
+        free(node->marks);
+        free(node->dependents);
+        free(node);
+        node = next;
+    }
+}
+
+static int cf_thrd_helper(void* queue) {
+    cf_work_queue* q = (cf_work_queue*) queue;
+    cf_thrd_job job;
+    mtx_t* lock = &q->lock;
+
+    while (true) {
+        mtx_lock(lock);
+        while (cf_empty_job() && q->ready_head == NULL) {
+            if (q->shutdown) {
+                mtx_unlock(lock);
+                return 0;
+            }
+
+            cnd_wait(&q->new_job, lock);
+        }
+        if (q->ready_head != NULL) {
+            job = q->ready_head->job;
+            q->ready_head = q->ready_head->next_ready;
+        } else {
+            cf_dequeue_job(&job);
+            cnd_signal(&q->free_slot);
+        }
+
+        /* Another worker may be looking the job's action up in a batch */
+        while (job.action != NULL && job.action->prefetching) {
+            cnd_wait(&q->prefetched, lock);
+        }
+
+        /* Once the build failed, queued commands are drained without running */
+        bool run = (job.fn != NULL || !q->failed);
+        if (run) {
+            q->running_jobs++;
+        }
+        mtx_unlock(lock);
+
+        bool ok = run;
+        if (job.fn != NULL) {
+            job.fn(job.arg);
+        } else {
+            ok = run && cf_run_job_command(job.command, job.action, job.env->envp, true);
+        }
+
+        bool free_env = false;
+        cf_deferred_mark_t* marks = NULL;
+        size_t num_marks = 0;
+        mtx_lock(lock);
+        --q->active_jobs;
+
+        if (job.env != NULL) {
+            free_env = (--job.env->refs == 0);
+        }
+
+        /*
+         * A failed or dropped job never completes, so neither the jobs
+         * after it nor the marks waiting for it are committed. With -k only
+         * the jobs held for it are dropped, otherwise the main thread
+         * notices the failure at its next wait and exits.
+         */
+        if (!ok && run && cf_keep_going) {
+            cf_record_failure(job.target, job.command);
+            cf_job_fail(job.node);
+            if (job.target != NULL && --job.target->pending == 0) {
+                cnd_broadcast(&q->target_done);
+            }
+        } else if (!ok) {
+            q->failed = true;
+            cf_cancel_children(false);
+            cnd_broadcast(&q->target_done);
+            cnd_broadcast(&q->free_slot);
+        } else {
+            if (job.node != NULL) {
+                cf_job_complete(job.node);
+            }
+
+            /* Before its body returned, the marks of a job are left to the main thread */
+            if (job.node != NULL && job.node->num_marks > 0 && job.target->body_done) {
+                marks = job.node->marks;
+                num_marks = job.node->num_marks;
+                job.node->marks = NULL;
+                job.node->num_marks = 0;
+                job.node->marks_cap = 0;
+            }
+
+            /* The scheduler completes a target once its body and jobs are done */
+            if (marks == NULL && job.target != NULL && --job.target->pending == 0) {
+                cnd_broadcast(&q->target_done);
+            }
+        }
+
+        /* Committing marks still counts as running, so an exit saves the DB only after them */
+        if (run && marks == NULL) {
+            --q->running_jobs;
+        }
+        cnd_broadcast(&q->no_job);
+        mtx_unlock(lock);
+
+        if (marks != NULL) {
+            job.node->commit_marks(marks, num_marks, job.target->env_hash);
+            mtx_lock(lock);
+            --q->running_jobs;
+            if (--job.target->pending == 0) {
+                cnd_broadcast(&q->target_done);
+            }
+            cnd_broadcast(&q->no_job);
+            mtx_unlock(lock);
+        }
+
+        free(job.command);
+        free(job.action);
+        if (free_env) {
+            free(job.env);
+        }
+    }
+}
+
+static void cf_spawn_worker(void) {
+    if (cf_num_thrds >= cf_thrd_pool_cap) {
+        size_t ncap = (cf_thrd_pool_cap == 0) ? CF_INIT_THRDS : cf_thrd_pool_cap * 2;
+        thrd_t* npool = (thrd_t*) realloc(cf_thrd_pool, ncap * sizeof(thrd_t));
+        if (npool == NULL) {
+            CF_ERR_LOG("Error: realloc() failed in cf_spawn_worker()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+
+        cf_thrd_pool = npool;
+        cf_thrd_pool_cap = ncap;
+    }
+
+    thrd_t worker_thread;
+    if (thrd_create(&worker_thread, &cf_thrd_helper, (void*) global_workq) != thrd_success) {
+        CF_ERR_LOG("Error: Thread failed during creation in cf_spawn_worker()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    cf_thrd_pool[cf_num_thrds++] = worker_thread;
+}
+
+/*
+ * Stops the build on the main thread, called with global_workq->lock held
+ * after a command failed. exit() then runs cf_flush_on_exit(), which waits
+ * for the stopped commands and saves what was completed.
+ */
+__attribute__((noreturn)) static void cf_abort_build(void) {
+    global_workq->failed = true;
+    cf_cancel_children(false);
+    mtx_unlock(&global_workq->lock);
+    exit(CF_CLIB_FAIL_EC);
+}
+
+/*
+ * Enqueue a job, growing the pool lazily; blocks while the queue is full.
+ * A job that has unfinished jobs in after is held until they are done.
+ */
+static void cf_submit_job(cf_thrd_job job, const cf_job_t* after, size_t num_after) {
+    mtx_t* lock = &global_workq->lock;
+    mtx_lock(lock);
+    if (global_workq->failed) {
+        cf_abort_build();
+    }
+
+    /* With -k, a job queued after one that already failed is dropped right away */
+    for (size_t i = 0; i < num_after; i++) {
+        if (after[i] != NULL && after[i]->failed) {
+            job.node->failed = true;
+            if (job.target != NULL) {
+                job.target->failed = true;
+            }
+            mtx_unlock(lock);
+
+            free(job.command);
+            free(job.action);
+            job.node->job.command = NULL;
+            job.node->job.action = NULL;
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < num_after; i++) {
+        if (after[i] != NULL && !after[i]->done) {
+            cf_job_add_dependent(after[i], job.node);
+        }
+    }
+
+    if (job.node == NULL || job.node->waiting == 0) {
+        while (cf_full_job()) {
+            while (cf_num_thrds < cf_max_jobs) {
+                cf_spawn_worker();
+            }
+
+            cnd_wait(&global_workq->free_slot, lock);
+            if (global_workq->failed) {
+                cf_abort_build();
+            }
+        }
+
+        cf_enqueue_job(job);
+        cnd_signal(&global_workq->new_job);
+    }
+
+    ++global_workq->active_jobs;
+    if (job.target != NULL) {
+        ++job.target->pending;
+    }
+
+    if (job.env != NULL) {
+        ++job.env->refs;
+    }
+
+    if (global_workq->active_jobs > cf_num_thrds && cf_num_thrds < cf_max_jobs) {
+        cf_spawn_worker();
+    }
+
+    mtx_unlock(lock);
+}
+
+__attribute__((unused)) static cf_job_t cf_execute_command(bool is_parallel, char* buffer, const cf_job_t* after, size_t num_after, cf_action_t* action) {
+    if (cf_body_failed) {
+        free(buffer);
+        free(action);
+        return NULL;
+    }
+
+    if (is_verbose_target) {
+        printf("%s\n", buffer);
+    }
+
+    if (is_parallel) {
+        cf_job_node_t* node = (cf_job_node_t*) calloc(1, sizeof(cf_job_node_t));
+        if (node == NULL) {
+            CF_ERR_LOG("Error: calloc() failed in cf_execute_command()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+
+        node->job = (cf_thrd_job) {
+            .command = buffer,
+            .target = cf_cur_target,
+            .env = cf_env_snapshot(),
+            .node = node,
+            .action = action,
+        };
+
+        cf_job_node_t** owned = (cf_cur_target != NULL) ? &cf_cur_target->jobs : &cf_unowned_jobs;
+        node->seq = (cf_cur_target != NULL) ? cf_cur_target->num_jobs++ : 0;
+        node->next_owned = *owned;
+        *owned = node;
+
+        cf_submit_job(node->job, after, num_after);
+        return node;
+    }
+
+    if (!cf_run_job_command(buffer, action, environ, false)) {
+        mtx_lock(&global_workq->lock);
+        if (!cf_keep_going) {
+            cf_abort_build();
+        }
+
+        /* The rest of the body likely needs this command's outputs */
+        cf_record_failure(cf_cur_target, buffer);
+        if (cf_cur_target != NULL) {
+            cf_cur_target->failed = true;
+        }
+        cf_body_failed = true;
+        mtx_unlock(&global_workq->lock);
+    }
+
+    free(buffer);
+    free(action);
+    return NULL;
+}
+
+__attribute__((format(printf, 1, 0)))
+static char* cf_format_command(const char* format_str, va_list args) {
+    char* buffer = (char*) malloc(CF_MAX_COMMAND_LENGTH);
+    if (buffer == NULL) {
+        CF_ERR_LOG("Error: malloc() failed in cf_format_command()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    int n = vsnprintf(buffer, CF_MAX_COMMAND_LENGTH, format_str, args);
+    if (n < 0) {
+        CF_ERR_LOG("Error: snprintf() failed in cf_format_command()\n");
+        exit(CF_CLIB_FAIL_EC);
+    } else if (n >= CF_MAX_COMMAND_LENGTH) {
+        CF_ERR_LOG("Error: Maximum command length of %d was reached!\n", CF_MAX_COMMAND_LENGTH);
+        exit(CF_MAX_REACHED_EC);
+    }
+
+    return buffer;
+}
+
+/* Formats a command and runs it; a parallel one returns its job handle */
+__attribute__((format(printf, 4, 5)))
+__attribute__((unused))
+static cf_job_t cf_internal_runner(bool parallel, const cf_job_t* after, size_t num_after, const char* format_str, ...) {
+    va_list args;
+    va_start(args, format_str);
+    char* buffer = cf_format_command(format_str, args);
+    va_end(args);
+
+    return cf_execute_command(parallel, buffer, after, num_after, NULL);
+}
+
+__attribute__((unused)) static cf_group_t* cf_group_new(void) {
+    if (cf_num_groups >= CF_MAX_GROUPS) {
+        CF_ERR_LOG("Error: Maximum job groups of %d was reached!\n", CF_MAX_GROUPS);
+        exit(CF_MAX_REACHED_EC);
+    }
+
+    cf_group_t* group = (cf_group_t*) calloc(1, sizeof(cf_group_t));
+    if (group == NULL) {
+        CF_ERR_LOG("Error: calloc() failed in cf_group_new()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    cf_groups[cf_num_groups++] = group;
+    return group;
+}
+
+__attribute__((unused)) static cf_job_t cf_group_add(cf_group_t* group, cf_job_t job) {
+    if (job == NULL) {
+        return job;
+    }
+
+    if (group->count >= group->cap) {
+        size_t ncap = (group->cap == 0) ? 16 : group->cap * 2;
+        cf_job_t* njobs = (cf_job_t*) realloc(group->jobs, ncap * sizeof(cf_job_t));
+        if (njobs == NULL) {
+            CF_ERR_LOG("Error: realloc() failed in cf_group_add()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+
+        group->jobs = njobs;
+        group->cap = ncap;
+    }
+
+    group->jobs[group->count++] = job;
+    return job;
+}
+
+/*
+ * Blocks until every job added to the group so far has finished. With -k a
+ * failed job stops the rest of the body like a failed CF_RUN(...) does.
+ */
+__attribute__((unused)) static void cf_wait_group(cf_group_t* group) {
+    mtx_t* lock = &global_workq->lock;
+    mtx_lock(lock);
+    while (group->first_pending < group->count) {
+        if (group->jobs[group->first_pending]->failed) {
+            cf_body_failed = true;
+            group->first_pending++;
+        } else if (group->jobs[group->first_pending]->done) {
+            group->first_pending++;
+        } else if (global_workq->failed) {
+            cf_abort_build();
+        } else {
+            cnd_wait(&global_workq->no_job, lock);
+        }
+    }
+    mtx_unlock(lock);
+}
+
+/* Blocks until every job queued by the running target so far has finished, see cf_wait_group() */
+__attribute__((unused)) static void cf_wait_all(void) {
+    mtx_t* lock = &global_workq->lock;
+    mtx_lock(lock);
+    if (cf_cur_target != NULL) {
+        while (cf_cur_target->pending > 1) {
+            if (global_workq->failed) {
+                cf_abort_build();
+            }
+            cnd_wait(&global_workq->no_job, lock);
+        }
+
+        if (cf_cur_target->failed) {
+            cf_body_failed = true;
+        }
+    } else {
+        while (global_workq->active_jobs > 0) {
+            if (global_workq->failed) {
+                cf_abort_build();
+            }
+            cnd_wait(&global_workq->no_job, lock);
+        }
+    }
+    mtx_unlock(lock);
+}
+
+static void cf_free_groups(size_t checkpoint) {
+    while (cf_num_groups > checkpoint) {
+        cf_group_t* group = cf_groups[--cf_num_groups];
+        free(group->jobs);
+        free(group);
+        cf_groups[cf_num_groups] = NULL;
+    }
+}
+
+/* CForge DB implementation */
+static void cf_db_free(cf_db_mem_t* db) {
+    if (db == NULL) {
+        return;
+    }
+
+    cf_db_hdr_t* hdr = db->header;
+    if (hdr != NULL) {
+        free(hdr);
+        db->header = NULL;
+    }
+
+    /* Loaded entries and strings live inside the mapping */
+    if (db->map != NULL) {
+        munmap(db->map, db->map_sz);
+        db->map = NULL;
+        db->entries = NULL;
+        db->deps = NULL;
+        db->strings = NULL;
+    }
+
+    cf_db_entry_t* pentries = db->pending_entries;
+    if (pentries != NULL) {
+        free(pentries);
+        db->pending_entries = NULL;
+    }
+
+    cf_db_lstring_t* pstrings = db->pending_strings;
+    if (pstrings != NULL) {
+        free(pstrings);
+        db->pending_strings = NULL;
+    }
+
+    free(db->pending_deps);
+    db->pending_deps = NULL;
+    free(db->index);
+    db->index = NULL;
+    free(db->dirty);
+    db->dirty = NULL;
+    free(db->dirty_bits);
+    db->dirty_bits = NULL;
+
+    mtx_destroy(&db->lock);
+    free(db);
+}
+
+/*
+ * Entry refs address both entry arrays: refs below the loaded entry count
+ * point into db->entries, the rest into db->pending_entries.
+ */
+static inline cf_db_entry_t* cf_db_entry_at(cf_db_mem_t* db, size_t ref) {
+    if (ref < db->header->entry_cnt) {
+        return &db->entries[ref];
+    }
+
+    return &db->pending_entries[ref - db->header->entry_cnt];
+}
+
+static inline const char* cf_db_entry_path(cf_db_mem_t* db, size_t ref, uint16_t* len) {
+    uint8_t* slab = (ref < db->header->entry_cnt) ? (uint8_t*) db->strings : (uint8_t*) db->pending_strings;
+    cf_db_entry_t* entry = cf_db_entry_at(db, ref);
+    memcpy(len, slab + entry->path_offset, sizeof(uint16_t));
+    return (const char*) (slab + entry->path_offset + sizeof(uint16_t));
+}
+
+static inline size_t cf_db_entry_lists_cnt(const cf_db_entry_t* entry) {
+    return entry->deps_cnt + entry->scan_cnt;
+}
+
+/* Called with db->lock held, the pending deps move when they grow */
+static inline const uint64_t* cf_db_entry_deps(cf_db_mem_t* db, const cf_db_entry_t* entry) {
+    if (cf_db_entry_lists_cnt(entry) == 0) {
+        return NULL;
+    }
+
+    if (entry->deps_offset < db->header->deps_cnt) {
+        return &db->deps[entry->deps_offset];
+    }
+
+    return &db->pending_deps[entry->deps_offset - db->header->deps_cnt];
+}
+
+static inline bool cf_db_entry_matches(cf_db_mem_t* db, size_t ref, const char* path, size_t plen) {
+    uint16_t strl;
+    const char* strptr = cf_db_entry_path(db, ref, &strl);
+    return strl == plen && memcmp(path, strptr, plen) == 0;
+}
+
+static void cf_db_index_place(size_t* index, size_t cap, uint64_t hash, size_t ref) {
+    size_t mask = cap - 1;
+    size_t slot = (size_t) hash & mask;
+    while (index[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+
+    index[slot] = ref + 1;
+}
+
+static void cf_db_index_insert(cf_db_mem_t* db, size_t ref) {
+    /* Keep the load factor at or below 1/2 so probe chains stay short */
+    if ((db->index_cnt + 1) * 2 > db->index_cap) {
+        size_t ncap = (db->index_cap == 0) ? CF_INIT_DB_INDEX_SZ : db->index_cap * 2;
+        while ((db->index_cnt + 1) * 2 > ncap) {
+            ncap *= 2;
+        }
+
+        size_t* nindex = (size_t*) calloc(ncap, sizeof(size_t));
+        if (nindex == NULL) {
+            CF_ERR_LOG("Error: calloc() failed in cf_db_index_insert()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+
+        for (size_t i = 0; i < db->index_cap; i++) {
+            if (db->index[i] != 0) {
+                size_t oref = db->index[i] - 1;
+                cf_db_index_place(nindex, ncap, cf_db_entry_at(db, oref)->path_hash, oref);
+            }
+        }
+
+        free(db->index);
+        db->index = nindex;
+        db->index_cap = ncap;
+    }
+
+    cf_db_index_place(db->index, db->index_cap, cf_db_entry_at(db, ref)->path_hash, ref);
+    db->index_cnt++;
+}
+
+static void cf_db_index_build(cf_db_mem_t* db) {
+    for (size_t i = 0; i < db->header->entry_cnt; i++) {
+        cf_db_index_insert(db, i);
+    }
+}
+
+static size_t cf_db_lookup(cf_db_mem_t* db, const char* path, size_t plen) {
+    if (db->index_cnt == 0) {
+        return CF_DB_NO_REF;
+    }
+
+    uint64_t hash = cf_wh((const uint8_t*) path, plen, 0);
+    size_t mask = db->index_cap - 1;
+    for (size_t slot = (size_t) hash & mask; db->index[slot] != 0; slot = (slot + 1) & mask) {
+        size_t ref = db->index[slot] - 1;
+        if (hash != cf_db_entry_at(db, ref)->path_hash) {
+            continue;
+        }
+
+        if (cf_db_entry_matches(db, ref, path, plen)) {
+            return ref;
+        }
+
+        CF_WRN_LOG("Warning: Path hash collision detected!\n");
+    }
+
+    return CF_DB_NO_REF;
+}
+
+/* Like cf_db_lookup(), but only the variant of path recorded under env_hash */
+static size_t cf_db_lookup_env(cf_db_mem_t* db, const char* path, size_t plen, uint64_t env_hash) {
+    if (db->index_cnt == 0) {
+        return CF_DB_NO_REF;
+    }
+
+    uint64_t hash = cf_wh((const uint8_t*) path, plen, 0);
+    size_t mask = db->index_cap - 1;
+    for (size_t slot = (size_t) hash & mask; db->index[slot] != 0; slot = (slot + 1) & mask) {
+        size_t ref = db->index[slot] - 1;
+        const cf_db_entry_t* entry = cf_db_entry_at(db, ref);
+        if (hash == entry->path_hash && env_hash == entry->env_hash && cf_db_entry_matches(db, ref, path, plen)) {
+            return ref;
+        }
+    }
+
+    return CF_DB_NO_REF;
+}
+
+/* Prerequisites are stored as path hashes, this resolves them back to entries */
+static size_t cf_db_lookup_hash(cf_db_mem_t* db, uint64_t hash) {
+    if (db->index_cnt == 0) {
+        return CF_DB_NO_REF;
+    }
+
+    size_t mask = db->index_cap - 1;
+    for (size_t slot = (size_t) hash & mask; db->index[slot] != 0; slot = (slot + 1) & mask) {
+        size_t ref = db->index[slot] - 1;
+        if (hash == cf_db_entry_at(db, ref)->path_hash) {
+            return ref;
+        }
+    }
+
+    return CF_DB_NO_REF;
+}
+
+static size_t cf_db_append(cf_db_mem_t* db, const char* path, size_t strl) {
+    if (strl > UINT16_MAX) {
+        CF_ERR_LOG("Error: Path length exceeds UINT16 length\n");
+        exit(CF_MAX_REACHED_EC);
+    }
+
+    size_t needed = sizeof(uint16_t) + strl + 1;
+    if (db->pstrings_off + needed > db->pstrings_sz) {
+        size_t nsz = db->pstrings_sz * 2;
+        while (db->pstrings_off + needed > nsz) {
+            nsz *= 2;
+        }
+
+        cf_db_lstring_t* nstrings = (cf_db_lstring_t*) realloc(db->pending_strings, nsz);
+        if (nstrings == NULL) {
+            CF_ERR_LOG("Error: realloc() failed in cf_db_append() for strings\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+
+        db->pending_strings = nstrings;
+        db->pstrings_sz = nsz;
+    }
+
+    if (db->pentries_idx >= db->pentries_max) {
+        size_t nmax = db->pentries_max * 2;
+        cf_db_entry_t* nentries = (cf_db_entry_t*) realloc(db->pending_entries, nmax * sizeof(cf_db_entry_t));
+        if (nentries == NULL) {
+            CF_ERR_LOG("Error: realloc() failed in cf_db_append() for entries\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+
+        db->pending_entries = nentries;
+        db->pentries_max = nmax;
+    }
+
+    uint8_t* slab = (uint8_t*) db->pending_strings;
+    uint16_t len16 = (uint16_t) strl;
+    memcpy(slab + db->pstrings_off, &len16, sizeof(len16));
+    memcpy(slab + db->pstrings_off + sizeof(uint16_t), path, strl);
+    slab[db->pstrings_off + sizeof(uint16_t) + strl] = '\0';
+
+    size_t idx = db->pentries_idx++;
+    cf_db_entry_t* entry = &db->pending_entries[idx];
+    memset(entry, 0, sizeof(cf_db_entry_t));
+    entry->path_offset = db->pstrings_off;
+    entry->path_hash = cf_wh((const uint8_t*) path, strl, 0);
+    db->pstrings_off += needed;
+
+    size_t ref = db->header->entry_cnt + idx;
+    cf_db_index_insert(db, ref);
+    return ref;
+}
+
+static void cf_db_reserve_deps(cf_db_mem_t* db, size_t count) {
+    if (db->pdeps_cnt + count > db->pdeps_max) {
+        size_t nmax = (db->pdeps_max == 0) ? CF_INIT_PENDING_ENTRIES : db->pdeps_max;
+        while (db->pdeps_cnt + count > nmax) {
+            nmax *= 2;
+        }
+
+        uint64_t* ndeps = (uint64_t*) realloc(db->pending_deps, nmax * sizeof(uint64_t));
+        if (ndeps == NULL) {
+            CF_ERR_LOG("Error: realloc() failed in cf_db_reserve_deps()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+
+        db->pending_deps = ndeps;
+        db->pdeps_max = nmax;
+    }
+}
+
+/*
+ * Writes both lists of an entry as a new region of the pending deps, the old
+ * region is dropped on compaction. Neither list may point into pending_deps.
+ */
+static void cf_db_put_lists(cf_db_mem_t* db, size_t ref, const uint64_t* deps, size_t deps_cnt, const uint64_t* scan, size_t scan_cnt) {
+    cf_db_reserve_deps(db, deps_cnt + scan_cnt);
+    cf_db_entry_t* entry = cf_db_entry_at(db, ref);
+    uint64_t* region = &db->pending_deps[db->pdeps_cnt];
+    if (deps_cnt > 0) {
+        memcpy(region, deps, deps_cnt * sizeof(uint64_t));
+    }
+    if (scan_cnt > 0) {
+        memcpy(region + deps_cnt, scan, scan_cnt * sizeof(uint64_t));
+    }
+    entry->deps_offset = db->header->deps_cnt + db->pdeps_cnt;
+    entry->deps_cnt = deps_cnt;
+    entry->scan_cnt = scan_cnt;
+    db->pdeps_cnt += deps_cnt + scan_cnt;
+}
+
+/*
+ * Returns the variant of path recorded under env_hash, adding it if needed.
+ * Once a path has CF_DB_MAX_VARIANTS variants, the least recently marked one
+ * is cleared and reused, so switching configs back and forth stays cached.
+ */
+static size_t cf_db_variant(cf_db_mem_t* db, const char* path, size_t plen, uint64_t env_hash) {
+    uint64_t hash = cf_wh((const uint8_t*) path, plen, 0);
+    size_t oldest = CF_DB_NO_REF;
+    size_t count = 0;
+    size_t mask = db->index_cap - 1;
+    for (size_t slot = (size_t) hash & mask; db->index_cnt > 0 && db->index[slot] != 0; slot = (slot + 1) & mask) {
+        size_t ref = db->index[slot] - 1;
+        const cf_db_entry_t* entry = cf_db_entry_at(db, ref);
+        if (hash != entry->path_hash || !cf_db_entry_matches(db, ref, path, plen)) {
+            continue;
+        }
+
+        if (entry->env_hash == env_hash) {
+            return ref;
+        }
+
+        const cf_db_entry_t* old = (oldest != CF_DB_NO_REF) ? cf_db_entry_at(db, oldest) : NULL;
+        if (old == NULL || entry->mark_sec < old->mark_sec || (entry->mark_sec == old->mark_sec && entry->mark_nsec < old->mark_nsec)) {
+            oldest = ref;
+        }
+        count++;
+    }
+
+    if (count >= CF_DB_MAX_VARIANTS) {
+        cf_db_entry_t* entry = cf_db_entry_at(db, oldest);
+        *entry = (cf_db_entry_t) {
+            .path_hash = entry->path_hash,
+            .env_hash = env_hash,
+            .path_offset = entry->path_offset,
+        };
+        return oldest;
+    }
+
+    size_t ref = cf_db_append(db, path, plen);
+    cf_db_entry_at(db, ref)->env_hash = env_hash;
+    return ref;
+}
+
+/* Replaces the prerequisites of an entry and keeps its scanned includes */
+static void cf_db_set_deps(cf_db_mem_t* db, size_t ref, const uint64_t* deps, size_t count, uint64_t deps_hash) {
+    cf_db_entry_t* entry = cf_db_entry_at(db, ref);
+    size_t scan_cnt = entry->scan_cnt;
+    uint64_t* scan = NULL;
+    if (scan_cnt > 0) {
+        scan = (uint64_t*) malloc(scan_cnt * sizeof(uint64_t));
+        if (scan == NULL) {
+            CF_ERR_LOG("Error: malloc() failed in cf_db_set_deps()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+        memcpy(scan, cf_db_entry_deps(db, entry) + entry->deps_cnt, scan_cnt * sizeof(uint64_t));
+    }
+
+    cf_db_put_lists(db, ref, deps, count, scan, scan_cnt);
+    cf_db_entry_at(db, ref)->deps_hash = deps_hash;
+    free(scan);
+}
+
+/* Replaces the scanned includes of an entry and keeps its prerequisites */
+static void cf_db_set_scan(cf_db_mem_t* db, size_t ref, const uint64_t* scan, size_t count, uint64_t scan_key) {
+    cf_db_entry_t* entry = cf_db_entry_at(db, ref);
+    size_t deps_cnt = entry->deps_cnt;
+    uint64_t* deps = NULL;
+    if (deps_cnt > 0) {
+        deps = (uint64_t*) malloc(deps_cnt * sizeof(uint64_t));
+        if (deps == NULL) {
+            CF_ERR_LOG("Error: malloc() failed in cf_db_set_scan()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+        memcpy(deps, cf_db_entry_deps(db, entry), deps_cnt * sizeof(uint64_t));
+    }
+
+    cf_db_put_lists(db, ref, deps, deps_cnt, scan, count);
+    cf_db_entry_at(db, ref)->scan_key = scan_key;
+    free(deps);
+}
+
+static void cf_db_mark_dirty(cf_db_mem_t* db, size_t ref) {
+    if (ref / 8 >= db->dirty_bits_sz) {
+        size_t nsz = (db->dirty_bits_sz == 0) ? CF_INIT_PENDING_ENTRIES : db->dirty_bits_sz;
+        while (ref / 8 >= nsz) {
+            nsz *= 2;
+        }
+
+        uint8_t* nbits = (uint8_t*) realloc(db->dirty_bits, nsz);
+        if (nbits == NULL) {
+            CF_ERR_LOG("Error: realloc() failed in cf_db_mark_dirty()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+
+        memset(nbits + db->dirty_bits_sz, 0, nsz - db->dirty_bits_sz);
+        db->dirty_bits = nbits;
+        db->dirty_bits_sz = nsz;
+    }
+
+    uint8_t bit = (uint8_t) (1u << (ref % 8));
+    if ((db->dirty_bits[ref / 8] & bit) != 0) {
+        return;
+    }
+
+    if (db->dirty_cnt >= db->dirty_max) {
+        size_t nmax = (db->dirty_max == 0) ? CF_INIT_PENDING_ENTRIES : db->dirty_max * 2;
+        size_t* ndirty = (size_t*) realloc(db->dirty, nmax * sizeof(size_t));
+        if (ndirty == NULL) {
+            CF_ERR_LOG("Error: realloc() failed in cf_db_mark_dirty()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+
+        db->dirty = ndirty;
+        db->dirty_max = nmax;
+    }
+
+    db->dirty_bits[ref / 8] |= bit;
+    db->dirty[db->dirty_cnt++] = ref;
+}
+
+static inline size_t cf_db_record_sz(size_t path_len) {
+    return (sizeof(cf_db_record_t) + path_len + 7) & ~(size_t) 7;
+}
+
+static inline uint64_t cf_db_record_checksum(const cf_db_entry_t* entry, const char* path, size_t path_len, const uint64_t* deps) {
+    xxh64_state_t state;
+    xxh64_init(&state, path_len);
+    xxh64_update(&state, (const uint8_t*) entry, sizeof(cf_db_entry_t));
+    xxh64_update(&state, (const uint8_t*) path, path_len);
+    if (cf_db_entry_lists_cnt(entry) > 0) {
+        xxh64_update(&state, (const uint8_t*) deps, cf_db_entry_lists_cnt(entry) * sizeof(uint64_t));
+    }
+    return xxh64_digest(&state);
+}
+
+/* Apply journal records in file order, stopping at the first torn record */
+static void cf_db_replay_journal(cf_db_mem_t* db, size_t base_sz) {
+    uint8_t* map = (uint8_t*) db->map;
+    size_t off = base_sz;
+    while (off + sizeof(cf_db_record_t) <= db->map_sz) {
+        cf_db_record_t rec;
+        memcpy(&rec, map + off, sizeof(rec));
+        size_t rec_sz = cf_db_record_sz(rec.path_len);
+        if (rec.magic != CF_DB_RECORD_MAGIC || rec_sz > db->map_sz - off || rec.entry.deps_cnt > (db->map_sz - off - rec_sz) / sizeof(uint64_t)
+            || rec.entry.scan_cnt > (db->map_sz - off - rec_sz) / sizeof(uint64_t) - rec.entry.deps_cnt) {
+            break;
+        }
+
+        const char* path = (const char*) (map + off + sizeof(cf_db_record_t));
+        const uint64_t* deps = (const uint64_t*) (map + off + rec_sz);
+        if (cf_db_record_checksum(&rec.entry, path, rec.path_len, deps) != rec.checksum) {
+            break;
+        }
+
+        size_t ref = cf_db_variant(db, path, rec.path_len, rec.entry.env_hash);
+
+        cf_db_entry_t* entry = cf_db_entry_at(db, ref);
+        rec.entry.path_offset = entry->path_offset;
+        *entry = rec.entry;
+        cf_db_put_lists(db, ref, deps, rec.entry.deps_cnt, deps + rec.entry.deps_cnt, rec.entry.scan_cnt);
+        off += rec_sz + cf_db_entry_lists_cnt(&rec.entry) * sizeof(uint64_t);
+    }
+
+    db->journal_sz = off - base_sz;
+    db->journal_torn = (off != db->map_sz);
+}
+
+static cf_db_mem_t* cf_db_load(const char* db_path) {
+    int32_t fd = open(db_path, O_RDONLY);
+
+    cf_db_mem_t* db = (cf_db_mem_t*) malloc(sizeof(cf_db_mem_t));
+    cf_db_hdr_t* hdr = (cf_db_hdr_t*) malloc(sizeof(cf_db_hdr_t));
+    cf_db_entry_t* pentries = (cf_db_entry_t*) malloc(CF_INIT_PENDING_ENTRIES * sizeof(cf_db_entry_t));
+    cf_db_lstring_t* pstrings = (cf_db_lstring_t*) malloc(CF_INIT_PENDING_STRING_SZ);
+    if (db == NULL || hdr == NULL || pentries == NULL || pstrings == NULL) {
+        CF_ERR_LOG("Error: malloc() failed in cf_load_db() for db_mem\n");
+        if (fd >= 0) {
+            close(fd);
+        }
+    
+        free(hdr);
+        free(pentries);
+        free(pstrings);
+        free(db);
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    memset(db, 0, sizeof(cf_db_mem_t));
+    if (mtx_init(&db->lock, mtx_plain) != thrd_success) {
+        CF_ERR_LOG("Error: mtx_init() failed in cf_load_db()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    db->header = hdr;
+    db->pending_entries = pentries;
+    db->pending_strings = pstrings;
+    db->pentries_max = CF_INIT_PENDING_ENTRIES;
+    db->pstrings_sz = CF_INIT_PENDING_STRING_SZ;
+    db->pentries_idx = 0;
+    db->pstrings_off = 0;
+
+    /* A file too short for a header is what a crash during the first save leaves */
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t) st.st_size < sizeof(cf_db_hdr_t)) {
+        CF_WRN_LOG("Warning: DB at path is truncated, using default\n");
+        close(fd);
+        fd = -1;
+    } else if (fd < 0) {
+        CF_WRN_LOG("Warning: DB at path not found, using default\n");
+    }
+
+    /* Default when DB not found */
+    if (fd < 0) {
+        hdr->magic_header = CF_MAGIC_HEADER_VALUE;
+        hdr->version = CF_DB_CVERSION;
+        hdr->reserved = 0;
+        hdr->entry_cnt = 0;
+        hdr->deps_cnt = 0;
+        hdr->string_sz = 0;
+        db->entries = NULL;
+        db->deps = NULL;
+        db->strings = NULL;
+        return db;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        CF_ERR_LOG("Error: Could not read database header\n");
+        close(fd);
+        cf_db_free(db);
+        exit(CF_DB_FAIL_EC);
+    }
+
+    /*
+     * Private writable mapping: pages are shared with the page cache until an
+     * entry is updated in place, which then only copies the touched page.
+     */
+    db->map_sz = (size_t) st.st_size;
+    db->map = mmap(NULL, db->map_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (db->map == MAP_FAILED) {
+        db->map = NULL;
+        CF_ERR_LOG("Error: mmap() failed in cf_load_db()\n");
+        cf_db_free(db);
+        exit(CF_OS_FAIL_EC);
+    }
+
+    memcpy(hdr, db->map, sizeof(cf_db_hdr_t));
+    if (hdr->magic_header != CF_MAGIC_HEADER_VALUE) {
+        CF_ERR_LOG("Error: Magic database header code is invalid!\n");
+        cf_db_free(db);
+        exit(CF_DB_FAIL_EC);
+    }
+
+    if (hdr->version != CF_DB_CVERSION) {
+        CF_ERR_LOG("Error: CForge version (v%d) does not match database version (v%d)\n", CF_DB_CVERSION, hdr->version);
+        cf_db_free(db);
+        exit(CF_DB_FAIL_EC);
+    }
+
+    size_t avail = db->map_sz - sizeof(cf_db_hdr_t);
+    if (hdr->entry_cnt > avail / sizeof(cf_db_entry_t)
+        || hdr->deps_cnt > (avail - hdr->entry_cnt * sizeof(cf_db_entry_t)) / sizeof(uint64_t)
+        || hdr->string_sz > avail - hdr->entry_cnt * sizeof(cf_db_entry_t) - hdr->deps_cnt * sizeof(uint64_t)) {
+        CF_ERR_LOG("Error: Could not read database entries\n");
+        cf_db_free(db);
+        exit(CF_DB_FAIL_EC);
+    }
+
+    uint8_t* base = (uint8_t*) db->map + sizeof(cf_db_hdr_t);
+    db->entries = (cf_db_entry_t*) base;
+    db->deps = (uint64_t*) (base + hdr->entry_cnt * sizeof(cf_db_entry_t));
+    db->strings = (cf_db_lstring_t*) (base + hdr->entry_cnt * sizeof(cf_db_entry_t) + hdr->deps_cnt * sizeof(uint64_t));
+    for (size_t i = 0; i < hdr->entry_cnt; i++) {
+        const cf_db_entry_t* entry = &db->entries[i];
+        if (entry->deps_offset > hdr->deps_cnt || entry->deps_cnt > hdr->deps_cnt - entry->deps_offset
+            || entry->scan_cnt > hdr->deps_cnt - entry->deps_offset - entry->deps_cnt) {
+            CF_ERR_LOG("Error: Could not read database dependencies\n");
+            cf_db_free(db);
+            exit(CF_DB_FAIL_EC);
+        }
+    }
+    cf_db_index_build(db);
+    cf_db_replay_journal(db, sizeof(cf_db_hdr_t) + hdr->entry_cnt * sizeof(cf_db_entry_t) + hdr->deps_cnt * sizeof(uint64_t) + hdr->string_sz);
+    return db;
+}
+
+/* Rewrite the whole DB without a journal; the old file is replaced atomically */
+/* Persists a rename into the directory of path */
+static void cf_fsync_parent(const char* path) {
+    char dir[PATH_MAX];
+    const char* slash = strrchr(path, '/');
+    size_t len = (slash != NULL) ? (size_t) (slash - path) : 0;
+    if (len >= sizeof(dir)) {
+        return;
+    }
+
+    if (slash == NULL) {
+        memcpy(dir, ".", 2);
+    } else if (len == 0) {
+        memcpy(dir, "/", 2);
+    } else {
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+    }
+
+    int32_t fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static void cf_db_compact(const char* db_path, cf_db_mem_t* db) {
+    /* The old file stays mapped while writing, so never truncate it in place */
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", db_path) >= (int) sizeof(tmp_path)) {
+        CF_ERR_LOG("Error: Database path too long\n");
+        cf_db_free(db);
+        exit(CF_DB_FAIL_EC);
+    }
+
+    FILE* fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        CF_ERR_LOG("Error: Could not open database file\n");
+        cf_db_free(db);
+        exit(CF_DB_FAIL_EC);
+    }
+
+    /* Only the current prerequisite list of each entry survives */
+    cf_db_hdr_t* hdr = db->header;
+    size_t entry_cnt = hdr->entry_cnt;
+    size_t total_cnt = entry_cnt + db->pentries_idx;
+    size_t string_sz = hdr->string_sz;
+    cf_db_hdr_t out_hdr = *hdr;
+    out_hdr.entry_cnt = total_cnt;
+    out_hdr.deps_cnt = 0;
+    out_hdr.string_sz += db->pstrings_off;
+    for (size_t ref = 0; ref < total_cnt; ref++) {
+        out_hdr.deps_cnt += cf_db_entry_lists_cnt(cf_db_entry_at(db, ref));
+    }
+
+    if(fwrite(&out_hdr, sizeof(cf_db_hdr_t), 1, fp) != 1) {
+        CF_ERR_LOG("Error: Could not write database header\n");
+        fclose(fp);
+        cf_db_free(db);
+        exit(CF_DB_FAIL_EC);
+    }
+
+    size_t deps_offset = 0;
+    for (size_t ref = 0; ref < total_cnt; ref++) {
+        cf_db_entry_t patched = *cf_db_entry_at(db, ref);
+        if (ref >= entry_cnt) {
+            patched.path_offset += string_sz;
+        }
+        patched.deps_offset = deps_offset;
+        deps_offset += cf_db_entry_lists_cnt(&patched);
+
+        if (fwrite(&patched, sizeof(cf_db_entry_t), 1, fp) != 1) {
+            CF_ERR_LOG("Error: Could not write database entries\n");
+            fclose(fp);
+            cf_db_free(db);
+            exit(CF_DB_FAIL_EC);
+        }
+    }
+
+    for (size_t ref = 0; ref < total_cnt; ref++) {
+        cf_db_entry_t* entry = cf_db_entry_at(db, ref);
+        size_t lists_cnt = cf_db_entry_lists_cnt(entry);
+        if (lists_cnt > 0 && fwrite(cf_db_entry_deps(db, entry), sizeof(uint64_t), lists_cnt, fp) != lists_cnt) {
+            CF_ERR_LOG("Error: Could not write database dependencies\n");
+            fclose(fp);
+            cf_db_free(db);
+            exit(CF_DB_FAIL_EC);
+        }
+    }
+
+    if (db->strings != NULL) {
+        if (fwrite(db->strings, 1, string_sz, fp) != string_sz) {
+            CF_ERR_LOG("Error: Could not write database strings\n");
+            fclose(fp);
+            cf_db_free(db);
+            exit(CF_DB_FAIL_EC);
+        }
+    }
+
+    if (db->pstrings_off > 0) {
+        if (fwrite(db->pending_strings, 1, db->pstrings_off, fp) != db->pstrings_off) {
+            CF_ERR_LOG("Error: Could not write new database strings\n");
+            fclose(fp);
+            cf_db_free(db);
+            exit(CF_DB_FAIL_EC);
+        }
+    }
+
+    /* The data must be on disk before the rename is, or a crash can leave an empty DB behind */
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0 || fclose(fp) != 0 || rename(tmp_path, db_path) != 0) {
+        CF_ERR_LOG("Error: Could not commit database file\n");
+        cf_db_free(db);
+        exit(CF_DB_FAIL_EC);
+    }
+
+    cf_fsync_parent(db_path);
+}
+
+/* Append one record per dirty entry with a single write() */
+static bool cf_db_append_journal(const char* db_path, cf_db_mem_t* db) {
+    size_t total = 0;
+    for (size_t i = 0; i < db->dirty_cnt; i++) {
+        uint16_t plen;
+        cf_db_entry_path(db, db->dirty[i], &plen);
+        total += cf_db_record_sz(plen) + cf_db_entry_lists_cnt(cf_db_entry_at(db, db->dirty[i])) * sizeof(uint64_t);
+    }
+
+    uint8_t* buf = (uint8_t*) calloc(1, total);
+    if (buf == NULL) {
+        CF_ERR_LOG("Error: calloc() failed in cf_db_append_journal()\n");
+        cf_db_free(db);
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    size_t off = 0;
+    for (size_t i = 0; i < db->dirty_cnt; i++) {
+        uint16_t plen;
+        const char* path = cf_db_entry_path(db, db->dirty[i], &plen);
+        cf_db_record_t rec = {
+            .magic = CF_DB_RECORD_MAGIC,
+            .path_len = plen,
+            .reserved = 0,
+            .checksum = 0,
+            .entry = *cf_db_entry_at(db, db->dirty[i]),
+        };
+
+        const uint64_t* deps = cf_db_entry_deps(db, &rec.entry);
+        rec.entry.path_offset = 0;
+        rec.entry.deps_offset = 0;
+        rec.checksum = cf_db_record_checksum(&rec.entry, path, plen, deps);
+        memcpy(buf + off, &rec, sizeof(rec));
+        memcpy(buf + off + sizeof(rec), path, plen);
+        off += cf_db_record_sz(plen);
+        size_t lists_cnt = cf_db_entry_lists_cnt(&rec.entry);
+        if (lists_cnt > 0) {
+            memcpy(buf + off, deps, lists_cnt * sizeof(uint64_t));
+            off += lists_cnt * sizeof(uint64_t);
+        }
+    }
+
+    int32_t fd = open(db_path, O_WRONLY | O_APPEND);
+    if (fd < 0) {
+        free(buf);
+        return false;
+    }
+
+    bool ok = true;
+    for (off = 0; off < total;) {
+        ssize_t n = write(fd, buf + off, total - off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            /* A partial record is discarded by its checksum on the next load */
+            ok = false;
+            break;
+        }
+
+        off += (size_t) n;
+    }
+
+    free(buf);
+    if (close(fd) != 0) {
+        ok = false;
+    }
+
+    return ok;
+}
+
+/*
+ * Only entries updated during this run are appended to the journal. Once the
+ * journal outgrows the compacted part of the file (or a torn record was found)
+ * the whole DB is rewritten.
+ */
+static void cf_db_write(const char* db_path, cf_db_mem_t* db) {
+    if (db->dirty_cnt > 0) {
+        size_t base_sz = db->map_sz - db->journal_sz;
+        size_t journal_sz = db->journal_sz + db->dirty_cnt * sizeof(cf_db_record_t);
+        bool compact = db->map == NULL || db->journal_torn || (journal_sz > CF_DB_MIN_COMPACT_SZ && journal_sz > base_sz);
+        if (compact || !cf_db_append_journal(db_path, db)) {
+            cf_db_compact(db_path, db);
+        }
+    }
+}
+
+static void cf_db_save(const char* db_path, cf_db_mem_t* db) {
+    if (db == NULL) {
+        CF_ERR_LOG("Error: db passed to cf_save_db() is NULL");
+        return;
+    }
+
+    cf_db_write(db_path, db);
+    cf_db_free(db);
+}
+
+/* Saves and releases global_db at the end of the build */
+static void cf_db_save_global(void) {
+    mtx_lock(&cf_db_save_lock);
+    if (global_db != NULL) {
+        cf_db_save(CF_DB_PATH, global_db);
+        global_db = NULL;
+    }
+    mtx_unlock(&cf_db_save_lock);
+}
+
+/*
+ * Saves global_db right before a second signal terminates the process. Both
+ * locks stay held, so neither a worker nor the exit path changes it after.
+ */
+static void cf_db_save_dying(void) {
+    mtx_lock(&cf_db_save_lock);
+    if (global_db != NULL) {
+        mtx_lock(&global_db->lock);
+        cf_db_write(CF_DB_PATH, global_db);
+    }
+}
+
+static void cf_db_open_global(void) {
+    global_db = cf_db_load(CF_DB_PATH);
+}
+
+/* The DB is only mapped once the first UTD call needs it */
+static inline cf_db_mem_t* cf_db_get(void) {
+    call_once(&global_db_once, cf_db_open_global);
+    return global_db;
+}
+
+/* DB keys can't collide with paths: they start with a NUL byte, then 'T' or 'V' */
+static size_t cf_env_db_key(char* key, size_t size, char kind, const char* name) {
+    size_t len = strlen(name);
+    if (len + 2 > size) {
+        return 0;
+    }
+
+    key[0] = '\0';
+    key[1] = kind;
+    memcpy(key + 2, name, len);
+    return len + 2;
+}
+
+/* Tracks the variables the target read through CF_ENV(...) during its last run */
+static void cf_env_load_deps(cf_target_decl_t* target) {
+    if (global_db == NULL && access(CF_DB_PATH, F_OK) != 0) {
+        return;
+    }
+
+    char key[CF_MAX_NAME_LENGTH + 3];
+    size_t key_len = cf_env_db_key(key, sizeof(key), 'T', target->name);
+    cf_db_mem_t* db = cf_db_get();
+    char* names[CF_MAX_ENVS];
+    size_t count = 0;
+
+    mtx_lock(&db->lock);
+    size_t ref = cf_db_lookup(db, key, key_len);
+    if (ref != CF_DB_NO_REF) {
+        const cf_db_entry_t* entry = cf_db_entry_at(db, ref);
+        const uint64_t* vars = cf_db_entry_deps(db, entry);
+        for (size_t i = 0; i < entry->deps_cnt && count < CF_MAX_ENVS; i++) {
+            size_t var_ref = cf_db_lookup_hash(db, vars[i]);
+            uint16_t len = 0;
+            const char* var_key = (var_ref != CF_DB_NO_REF) ? cf_db_entry_path(db, var_ref, &len) : NULL;
+            if (var_key == NULL || len < 3 || var_key[0] != '\0' || var_key[1] != 'V') {
+                continue;
+            }
+
+            names[count] = strndup(var_key + 2, (size_t) len - 2);
+            if (names[count] == NULL) {
+                CF_ERR_LOG("Error: strndup() failed in cf_env_load_deps()\n");
+                exit(CF_CLIB_FAIL_EC);
+            }
+            count++;
+        }
+    }
+    mtx_unlock(&db->lock);
+
+    for (size_t i = 0; i < count; i++) {
+        if (cf_env_dep_find(names[i]) == SIZE_MAX) {
+            cf_env_dep_add(names[i], ENV_DEP_READ);
+        }
+        free(names[i]);
+    }
+}
+
+/*
+ * The running body takes cenv_hash from here whenever it is about to check or
+ * mark against the DB. Its tracked variables are loaded on the first call, so
+ * a body that never uses the DB doesn't have to open it.
+ */
+static uint64_t cf_env_hash(void) {
+    if (cf_env_frozen && !cf_env_deps_loaded && cf_cur_target != NULL) {
+        cf_env_deps_loaded = true;
+        cf_env_load_deps(cf_cur_target);
+    }
+
+    return cenv_hash;
+}
+
+__attribute__((unused)) static cf_db_entry_t* cf_db_find(char* path, cf_db_mem_t* db) {
+    size_t ref = cf_db_lookup(db, path, strlen(path));
+    if (ref == CF_DB_NO_REF) {
+        return NULL;
+    }
+
+    return cf_db_entry_at(db, ref);
+}
+
+static bool cf_db_hash_file(char* path, uint64_t* hash) {
+#ifdef CF_DISABLE_FILE_HASH
+    (void) path;
+    *hash = 0;
+    return true;
+#else
+    static const uint64_t seed = 0;
+    return cf_hash_file_seeds(path, &seed, hash, 1);
+#endif // CF_DISABLE_FILE_HASH
+}
+
+/* Records a fingerprint taken from st and hash, called with db->lock held */
+static size_t cf_db_store(cf_db_mem_t* db, const char* path, const struct stat* st, uint64_t hash, uint64_t env_hash) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    size_t ref = cf_db_variant(db, path, strlen(path), env_hash);
+    cf_db_entry_t* entry = cf_db_entry_at(db, ref);
+    entry->mtime_sec = (uint64_t) st->st_mtim.tv_sec;
+    entry->mtime_nsec = (uint64_t) st->st_mtim.tv_nsec;
+    entry->size = (uint64_t) st->st_size;
+    entry->env_hash = env_hash;
+    entry->content_hash = hash;
+    entry->mark_sec = (uint64_t) now.tv_sec;
+    entry->mark_nsec = (uint64_t) now.tv_nsec;
+    cf_db_mark_dirty(db, ref);
+    return ref;
+}
+
+/* Records the file as up to date for the environment hashing to env_hash */
+static void cf_db_mark_utd_env(char* path, cf_db_mem_t* db, uint64_t env_hash) {
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        return;
+    }
+
+    uint64_t hash = 0;
+    if (!cf_db_hash_file(path, &hash)) {
+        return;
+    }
+
+    mtx_lock(&db->lock);
+    cf_db_store(db, path, &st, hash, env_hash);
+    mtx_unlock(&db->lock);
+}
+
+__attribute__((unused)) static void cf_db_mark_utd(char* path, cf_db_mem_t* db) {
+    if (cf_body_failed) {
+        return;
+    }
+
+    cf_db_mark_utd_env(path, db, cf_env_hash());
+}
+
+/*
+ * An mtime within the racy window of the time it was recorded can't be
+ * trusted: the file may have been written again within the same timestamp
+ * granularity without its mtime changing.
+ */
+static inline bool cf_db_is_racy(uint64_t mtime_sec, uint64_t mtime_nsec, uint64_t ref_sec, uint64_t ref_nsec) {
+    uint64_t mtime = mtime_sec * 1000000000ull + mtime_nsec;
+    uint64_t ref = ref_sec * 1000000000ull + ref_nsec;
+    return mtime + CF_RACY_WINDOW_NS >= ref;
+}
+
+#ifndef CF_DISABLE_FILE_HASH
+/* Content turned out unchanged: refresh the fingerprint so the next run can trust the metadata again */
+static void cf_db_refresh(cf_db_mem_t* db, size_t ref, const struct stat* st, uint64_t hash) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (cf_db_is_racy((uint64_t) st->st_mtim.tv_sec, (uint64_t) st->st_mtim.tv_nsec, (uint64_t) now.tv_sec, (uint64_t) now.tv_nsec)) {
+        return;
+    }
+
+    mtx_lock(&db->lock);
+    cf_db_entry_t* live = cf_db_entry_at(db, ref);
+    if (live->content_hash == hash) {
+        live->mtime_sec = (uint64_t) st->st_mtim.tv_sec;
+        live->mtime_nsec = (uint64_t) st->st_mtim.tv_nsec;
+        live->mark_sec = (uint64_t) now.tv_sec;
+        live->mark_nsec = (uint64_t) now.tv_nsec;
+        cf_db_mark_dirty(db, ref);
+    }
+    mtx_unlock(&db->lock);
+}
+#endif // CF_DISABLE_FILE_HASH
+
+/*
+ * Current fingerprint of a prerequisite: its size and content hash, or its
+ * mtime without file hashing. The prerequisite's CF_DB_PREREQ_ENV variant
+ * caches the hash. A changed prerequisite is recorded there by the first
+ * check that hashes it, so the dependents checked after it reuse the hash.
+ */
+static bool cf_db_dep_fingerprint(cf_db_mem_t* db, const char* path, bool mark, uint64_t* fingerprint) {
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        return false;
+    }
+
+    mtx_lock(&db->lock);
+    size_t ref = cf_db_lookup_env(db, path, strlen(path), CF_DB_PREREQ_ENV);
+    cf_db_entry_t entry = { 0 };
+    if (ref != CF_DB_NO_REF) {
+        entry = *cf_db_entry_at(db, ref);
+    }
+    mtx_unlock(&db->lock);
+
+    bool same = ref != CF_DB_NO_REF
+        && entry.size == (uint64_t) st.st_size
+        && entry.mtime_sec == (uint64_t) st.st_mtim.tv_sec
+        && entry.mtime_nsec == (uint64_t) st.st_mtim.tv_nsec;
+    fingerprint[0] = (uint64_t) st.st_size;
+
+#ifdef CF_DISABLE_FILE_HASH
+    fingerprint[1] = (uint64_t) st.st_mtim.tv_sec * 1000000000ull + (uint64_t) st.st_mtim.tv_nsec;
+    if (mark && !same) {
+        mtx_lock(&db->lock);
+        cf_db_store(db, path, &st, 0, CF_DB_PREREQ_ENV);
+        mtx_unlock(&db->lock);
+    }
+
+    return true;
+#else
+    if (same && !cf_db_is_racy(entry.mtime_sec, entry.mtime_nsec, entry.mark_sec, entry.mark_nsec)) {
+        fingerprint[1] = entry.content_hash;
+        return true;
+    }
+
+    uint64_t hash = 0;
+    if (!cf_db_hash_file((char*) path, &hash)) {
+        return false;
+    }
+    fingerprint[1] = hash;
+
+    if (mark || ref == CF_DB_NO_REF || entry.content_hash != hash) {
+        mtx_lock(&db->lock);
+        cf_db_store(db, path, &st, hash, CF_DB_PREREQ_ENV);
+        mtx_unlock(&db->lock);
+    } else {
+        cf_db_refresh(db, ref, &st, hash);
+    }
+
+    return true;
+#endif // CF_DISABLE_FILE_HASH
+}
+
+/*
+ * Reads the prerequisites of a Makefile-syntax depfile as written by -MD.
+ * Paths are unescaped in place in the returned buffer. Targets, the phony
+ * rules of -MP and line continuations are skipped.
+ */
+static char* cf_depfile_read(const char* depfile, char*** prereqs, size_t* count) {
+    int32_t fd = open(depfile, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    size_t size = (size_t) st.st_size;
+    char* buf = (char*) malloc(size + 1);
+    if (buf == NULL) {
+        CF_ERR_LOG("Error: malloc() failed in cf_depfile_read()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = read(fd, buf + got, size - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            break;
+        }
+        got += (size_t) n;
+    }
+    close(fd);
+
+    char** list = NULL;
+    size_t cap = 0;
+    size_t num = 0;
+    bool in_prereqs = false;
+    char* in = buf;
+    char* out = buf;
+    char* end = buf + got;
+    while (in < end) {
+        if (*in == ' ' || *in == '\t' || *in == '\r') {
+            in++;
+            continue;
+        }
+
+        if (*in == '\n') {
+            in_prereqs = false;
+            in++;
+            continue;
+        }
+
+        if (*in == '\\' && in + 1 < end && (in[1] == '\n' || in[1] == '\r')) {
+            in += (in + 2 < end && in[1] == '\r' && in[2] == '\n') ? 3 : 2;
+            continue;
+        }
+
+        /* gcc escapes spaces and '#' with a backslash and '$' as "$$" */
+        char* token = out;
+        while (in < end && *in != ' ' && *in != '\t' && *in != '\r' && *in != '\n') {
+            if (*in == '\\' && in + 1 < end && (in[1] == '\n' || in[1] == '\r')) {
+                break;
+            }
+
+            if ((*in == '\\' && in + 1 < end && (in[1] == ' ' || in[1] == '#')) || (*in == '$' && in + 1 < end && in[1] == '$')) {
+                in++;
+            }
+            *out++ = *in++;
+        }
+
+        /*
+         * The delimiter must be consumed before it can be overwritten by the
+         * terminator, a continuation right after the token included
+         */
+        bool line_end = false;
+        if (in < end && *in == '\\') {
+            in += (in + 2 < end && in[1] == '\r' && in[2] == '\n') ? 3 : 2;
+        } else if (in < end) {
+            line_end = (*in == '\n');
+            in++;
+        }
+
+        size_t len = (size_t) (out - token);
+        *out++ = '\0';
+        if (!in_prereqs) {
+            in_prereqs = (len > 0 && token[len - 1] == ':');
+        } else if (len > 0) {
+            if (num == cap) {
+                cap = (cap == 0) ? 32 : cap * 2;
+                char** nlist = (char**) realloc(list, cap * sizeof(char*));
+                if (nlist == NULL) {
+                    CF_ERR_LOG("Error: realloc() failed in cf_depfile_read()\n");
+                    exit(CF_CLIB_FAIL_EC);
+                }
+                list = nlist;
+            }
+            list[num++] = token;
+        }
+
+        if (line_end) {
+            in_prereqs = false;
+        }
+    }
+
+    *prereqs = list;
+    *count = num;
+    return buf;
+}
+
+/* Marks path up to date together with its prerequisites, if one is gone path stays stale */
+static void cf_db_mark_prereqs(char* path, char** prereqs, size_t count, cf_db_mem_t* db, uint64_t env_hash) {
+    uint64_t* deps = (uint64_t*) malloc((count + 1) * sizeof(uint64_t));
+    if (deps == NULL) {
+        CF_ERR_LOG("Error: malloc() failed in cf_db_mark_prereqs()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    /* The fingerprints are hashed in list order, the check walks the same order */
+    xxh64_state_t state;
+    xxh64_init(&state, 0);
+    size_t num_deps = 0;
+    bool ok = true;
+    for (size_t i = 0; i < count && ok; i++) {
+        if (strcmp(prereqs[i], path) == 0) {
+            continue;
+        }
+
+        uint64_t fingerprint[2];
+        ok = cf_db_dep_fingerprint(db, prereqs[i], true, fingerprint);
+        if (!ok) {
+            break;
+        }
+        xxh64_update(&state, (const uint8_t*) fingerprint, sizeof(fingerprint));
+        deps[num_deps++] = cf_wh((const uint8_t*) prereqs[i], strlen(prereqs[i]), 0);
+    }
+
+    struct stat st;
+    uint64_t hash = 0;
+    if (ok && stat(path, &st) == 0 && cf_db_hash_file(path, &hash)) {
+        mtx_lock(&db->lock);
+        size_t ref = cf_db_store(db, path, &st, hash, env_hash);
+        cf_db_set_deps(db, ref, deps, num_deps, xxh64_digest(&state));
+        mtx_unlock(&db->lock);
+    }
+
+    free(deps);
+}
+
+/*
+ * Marks path up to date together with the prerequisites its depfile lists,
+ * then removes the depfile. Without a readable depfile path stays stale.
+ */
+static void cf_db_mark_deps(char* path, const char* depfile, cf_db_mem_t* db, uint64_t env_hash) {
+    char** prereqs = NULL;
+    size_t count = 0;
+    char* buf = cf_depfile_read(depfile, &prereqs, &count);
+    if (buf == NULL) {
+        CF_WRN_LOG("Warning: Could not read depfile \"%s\" of \"%s\"!\n", depfile, path);
+        return;
+    }
+
+    cf_db_mark_prereqs(path, prereqs, count, db, env_hash);
+    free(prereqs);
+    free(buf);
+    unlink(depfile);
+}
+
+/* NUL-separated strings appended back to back */
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+    size_t count;
+} cf_scan_buf_t;
+
+static void cf_scan_buf_add(cf_scan_buf_t* buf, const char* str, size_t len) {
+    if (buf->len + len + 1 > buf->cap) {
+        size_t ncap = (buf->cap == 0) ? CF_INIT_PENDING_STRING_SZ : buf->cap * 2;
+        while (buf->len + len + 1 > ncap) {
+            ncap *= 2;
+        }
+
+        char* ndata = (char*) realloc(buf->data, ncap);
+        if (ndata == NULL) {
+            CF_ERR_LOG("Error: realloc() failed in cf_scan_buf_add()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+
+        buf->data = ndata;
+        buf->cap = ncap;
+    }
+
+    memcpy(buf->data + buf->len, str, len);
+    buf->data[buf->len + len] = '\0';
+    buf->len += len + 1;
+    buf->count++;
+}
+
+/* Open-addressing set of path hashes, 0 marks a free slot */
+typedef struct {
+    uint64_t* slots;
+    size_t cap;
+    size_t count;
+} cf_scan_set_t;
+
+static void cf_scan_set_place(uint64_t* slots, size_t cap, uint64_t hash) {
+    size_t mask = cap - 1;
+    size_t slot = (size_t) hash & mask;
+    while (slots[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+
+    slots[slot] = hash;
+}
+
+/* Returns false if hash was already in the set */
+static bool cf_scan_set_add(cf_scan_set_t* set, uint64_t hash) {
+    hash = (hash == 0) ? 1 : hash;
+    if (set->cap > 0) {
+        size_t mask = set->cap - 1;
+        for (size_t slot = (size_t) hash & mask; set->slots[slot] != 0; slot = (slot + 1) & mask) {
+            if (set->slots[slot] == hash) {
+                return false;
+            }
+        }
+    }
+
+    if ((set->count + 1) * 2 > set->cap) {
+        size_t ncap = (set->cap == 0) ? CF_INIT_DB_INDEX_SZ : set->cap * 2;
+        uint64_t* nslots = (uint64_t*) calloc(ncap, sizeof(uint64_t));
+        if (nslots == NULL) {
+            CF_ERR_LOG("Error: calloc() failed in cf_scan_set_add()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+
+        for (size_t i = 0; i < set->cap; i++) {
+            if (set->slots[i] != 0) {
+                cf_scan_set_place(nslots, ncap, set->slots[i]);
+            }
+        }
+
+        free(set->slots);
+        set->slots = nslots;
+        set->cap = ncap;
+    }
+
+    cf_scan_set_place(set->slots, set->cap, hash);
+    set->count++;
+    return true;
+}
+
+/* Include directories taken from the -I flags of e.g. CF_ENV(includes) */
+typedef struct {
+    char* buf;
+    char** dirs;
+    size_t count;
+} cf_incdirs_t;
+
+static void cf_incdirs_parse(const char* includes, cf_incdirs_t* incdirs) {
+    const char* flags = (includes != NULL) ? includes : "";
+    size_t len = strlen(flags);
+    incdirs->buf = strdup(flags);
+    incdirs->dirs = (char**) malloc((len / 2 + 1) * sizeof(char*));
+    if (incdirs->buf == NULL || incdirs->dirs == NULL) {
+        CF_ERR_LOG("Error: malloc() failed in cf_incdirs_parse()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    incdirs->count = 0;
+
+    bool want_dir = false;
+    char* save = NULL;
+    for (char* tok = strtok_r(incdirs->buf, " \t\r\n", &save); tok != NULL; tok = strtok_r(NULL, " \t\r\n", &save)) {
+        if (want_dir) {
+            incdirs->dirs[incdirs->count++] = tok;
+            want_dir = false;
+        } else if (strcmp(tok, "-I") == 0) {
+            want_dir = true;
+        } else if (strncmp(tok, "-I", 2) == 0) {
+            incdirs->dirs[incdirs->count++] = tok + 2;
+        }
+    }
+}
+
+static void cf_incdirs_free(cf_incdirs_t* incdirs) {
+    free(incdirs->buf);
+    free(incdirs->dirs);
+}
+
+/* Drops "." and empty segments and folds "dir/.." so every header has one spelling */
+static void cf_path_normalize(char* path) {
+    bool absolute = (path[0] == '/');
+    char* base = path + absolute;
+    char* out = base;
+    char* in = base;
+    while (*in != '\0') {
+        char* seg = in;
+        size_t len = strcspn(in, "/");
+        in += len;
+        if (*in == '/') {
+            in++;
+        }
+
+        if (len == 0 || (len == 1 && seg[0] == '.')) {
+            continue;
+        }
+
+        if (len == 2 && seg[0] == '.' && seg[1] == '.' && out > base) {
+            char* prev = out;
+            while (prev > base && prev[-1] != '/') {
+                prev--;
+            }
+
+            if (!(out - prev == 2 && prev[0] == '.' && prev[1] == '.')) {
+                out = (prev > base) ? prev - 1 : base;
+                continue;
+            }
+        }
+
+        if (out > base) {
+            *out++ = '/';
+        }
+        memmove(out, seg, len);
+        out += len;
+    }
+
+    if (out == path) {
+        *out++ = '.';
+    }
+    *out = '\0';
+}
+
+/*
+ * Appends the names of the #include directives in path to names, each
+ * prefixed with the opening quote or bracket. Directives inside comments or
+ * disabled conditionals are picked up too, which only adds prerequisites.
+ */
+static bool cf_scan_directives(const char* path, cf_scan_buf_t* names) {
+    int32_t fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    size_t size = (size_t) st.st_size;
+    if (size == 0) {
+        close(fd);
+        return true;
+    }
+
+    const char* map = (const char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == (const char*) MAP_FAILED) {
+        return false;
+    }
+
+    const char* end = map + size;
+    const char* p = map;
+    const char* hash;
+    while ((hash = (const char*) memchr(p, '#', (size_t) (end - p))) != NULL) {
+        p = hash + 1;
+        const char* line = hash;
+        while (line > map && (line[-1] == ' ' || line[-1] == '\t')) {
+            line--;
+        }
+
+        if (line > map && line[-1] != '\n') {
+            continue;
+        }
+
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        if (end - p < 8 || memcmp(p, "include", 7) != 0 || (p[7] != ' ' && p[7] != '\t' && p[7] != '"' && p[7] != '<')) {
+            continue;
+        }
+
+        p += 7;
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        if (p == end || (*p != '"' && *p != '<')) {
+            continue;
+        }
+
+        char close_char = (*p == '"') ? '"' : '>';
+        const char* start = p + 1;
+        const char* stop = (const char*) memchr(start, close_char, (size_t) (end - start));
+        const char* eol = (const char*) memchr(start, '\n', (size_t) (end - start));
+        if (stop == NULL || (eol != NULL && eol < stop) || stop == start) {
+            continue;
+        }
+
+        char name[PATH_MAX];
+        size_t len = (size_t) (stop - start);
+        if (len + 1 < sizeof(name)) {
+            name[0] = *p;
+            memcpy(name + 1, start, len);
+            cf_scan_buf_add(names, name, len + 1);
+        }
+        p = stop + 1;
+    }
+
+    munmap((void*) map, size);
+    return true;
+}
+
+/* Quoted names are looked up next to the including file first, then in the -I directories */
+static bool cf_scan_resolve(const char* from, const char* name, const cf_incdirs_t* incdirs, char* out, size_t size) {
+    bool quoted = (name[0] == '"');
+    name++;
+
+    for (size_t i = 0; i < incdirs->count + quoted; i++) {
+        int32_t n;
+        if (quoted && i == 0) {
+            const char* slash = strrchr(from, '/');
+            int32_t dir_len = (slash != NULL) ? (int32_t) (slash - from) : 0;
+            n = (slash != NULL) ? snprintf(out, size, "%.*s/%s", dir_len, from, name) : snprintf(out, size, "%s", name);
+        } else {
+            n = snprintf(out, size, "%s/%s", incdirs->dirs[i - quoted], name);
+        }
+
+        if (n < 0 || (size_t) n >= size) {
+            continue;
+        }
+
+        cf_path_normalize(out);
+        struct stat st;
+        if (stat(out, &st) == 0 && S_ISREG(st.st_mode)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Collects path and everything it includes, transitively, into found. The
+ * raw directive names of each file are cached in its DB entry, packed into
+ * the scan list and keyed by its fingerprint alone, so unchanged files are
+ * never read twice. Names are resolved against the -I flags on every scan,
+ * which picks up shadowing or removed headers. Includes found in no directory
+ * (system headers) are skipped.
+ */
+static bool cf_scan_closure(cf_db_mem_t* db, const char* path, const cf_incdirs_t* incdirs, cf_scan_buf_t* found) {
+    cf_scan_set_t seen = { 0 };
+    cf_scan_set_add(&seen, cf_wh((const uint8_t*) path, strlen(path), 0));
+    cf_scan_buf_add(found, path, strlen(path));
+
+    bool ok = true;
+    cf_scan_buf_t names = { 0 };
+    uint64_t* scan = NULL;
+    size_t scan_max = 0;
+    for (size_t off = 0; off < found->len;) {
+        char file[PATH_MAX];
+        size_t file_len = strlen(found->data + off);
+        bool is_root = (off == 0);
+        off += file_len + 1;
+        if (file_len >= sizeof(file)) {
+            continue;
+        }
+        memcpy(file, found->data + off - file_len - 1, file_len + 1);
+
+        uint64_t fingerprint[2];
+        if (!cf_db_dep_fingerprint(db, file, true, fingerprint)) {
+            ok = !is_root;
+            if (is_root) {
+                break;
+            }
+            continue;
+        }
+        uint64_t key = cf_wh((const uint8_t*) fingerprint, sizeof(fingerprint), 0);
+        key = (key == 0) ? 1 : key;
+
+        names.len = 0;
+        names.count = 0;
+        mtx_lock(&db->lock);
+        size_t ref = cf_db_lookup_env(db, file, file_len, CF_DB_PREREQ_ENV);
+        bool cached = (ref != CF_DB_NO_REF && cf_db_entry_at(db, ref)->scan_key == key);
+        if (cached) {
+            /* Zero padding ends the packed names */
+            const cf_db_entry_t* entry = cf_db_entry_at(db, ref);
+            const char* packed = (const char*) (cf_db_entry_deps(db, entry) + entry->deps_cnt);
+            size_t packed_len = entry->scan_cnt * sizeof(uint64_t);
+            for (size_t name_off = 0; name_off < packed_len && packed[name_off] != '\0';) {
+                size_t len = strnlen(packed + name_off, packed_len - name_off);
+                cf_scan_buf_add(&names, packed + name_off, len);
+                name_off += len + 1;
+            }
+        }
+        mtx_unlock(&db->lock);
+
+        if (!cached) {
+            if (!cf_scan_directives(file, &names)) {
+                continue;
+            }
+
+            size_t scan_cnt = (names.len + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+            if (scan_cnt > scan_max) {
+                scan_max = scan_cnt;
+                uint64_t* nscan = (uint64_t*) realloc(scan, scan_max * sizeof(uint64_t));
+                if (nscan == NULL) {
+                    CF_ERR_LOG("Error: realloc() failed in cf_scan_closure()\n");
+                    exit(CF_CLIB_FAIL_EC);
+                }
+                scan = nscan;
+            }
+            if (scan_cnt > 0) {
+                scan[scan_cnt - 1] = 0;
+                memcpy(scan, names.data, names.len);
+            }
+
+            mtx_lock(&db->lock);
+            ref = cf_db_lookup_env(db, file, file_len, CF_DB_PREREQ_ENV);
+            if (ref != CF_DB_NO_REF) {
+                cf_db_set_scan(db, ref, scan, scan_cnt, key);
+                cf_db_mark_dirty(db, ref);
+            }
+            mtx_unlock(&db->lock);
+        }
+
+        for (size_t name_off = 0; name_off < names.len; name_off += strlen(names.data + name_off) + 1) {
+            char resolved[PATH_MAX];
+            if (!cf_scan_resolve(file, names.data + name_off, incdirs, resolved, sizeof(resolved))) {
+                continue;
+            }
+
+            size_t len = strlen(resolved);
+            if (cf_scan_set_add(&seen, cf_wh((const uint8_t*) resolved, len, 0))) {
+                cf_scan_buf_add(found, resolved, len);
+            }
+        }
+    }
+
+    free(scan);
+    free(names.data);
+    free(seen.slots);
+    return ok;
+}
+
+/*
+ * Marks path up to date together with every header it includes, as found by
+ * the built-in scanner instead of a compiler depfile.
+ */
+static void cf_db_mark_scan(char* path, const char* includes, cf_db_mem_t* db, uint64_t env_hash) {
+    cf_incdirs_t incdirs;
+    cf_incdirs_parse(includes, &incdirs);
+
+    cf_scan_buf_t found = { 0 };
+    if (cf_scan_closure(db, path, &incdirs, &found)) {
+        char** prereqs = (char**) malloc(found.count * sizeof(char*));
+        if (prereqs == NULL) {
+            CF_ERR_LOG("Error: malloc() failed in cf_db_mark_scan()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+
+        /* The first string is path itself */
+        size_t count = 0;
+        size_t off = strlen(found.data) + 1;
+        while (off < found.len) {
+            prereqs[count++] = found.data + off;
+            off += strlen(found.data + off) + 1;
+        }
+
+        cf_db_mark_prereqs(path, prereqs, count, db, env_hash);
+        free(prereqs);
+    } else {
+        CF_WRN_LOG("Warning: Could not scan \"%s\" for includes!\n", path);
+    }
+
+    free(found.data);
+    cf_incdirs_free(&incdirs);
+}
+
+/* An entry with prerequisites is stale once one of them differs from when it was marked */
+static bool cf_db_deps_utd(cf_db_mem_t* db, size_t ref) {
+    mtx_lock(&db->lock);
+    cf_db_entry_t entry = *cf_db_entry_at(db, ref);
+    uint64_t* deps = NULL;
+    if (entry.deps_cnt > 0) {
+        deps = (uint64_t*) malloc(entry.deps_cnt * sizeof(uint64_t));
+        if (deps == NULL) {
+            CF_ERR_LOG("Error: malloc() failed in cf_db_deps_utd()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+        memcpy(deps, cf_db_entry_deps(db, &entry), entry.deps_cnt * sizeof(uint64_t));
+    }
+    mtx_unlock(&db->lock);
+
+    if (deps == NULL) {
+        return true;
+    }
+
+    xxh64_state_t state;
+    xxh64_init(&state, 0);
+    bool utd = true;
+    for (size_t i = 0; i < entry.deps_cnt && utd; i++) {
+        char dep[PATH_MAX];
+        mtx_lock(&db->lock);
+        size_t dep_ref = cf_db_lookup_hash(db, deps[i]);
+        uint16_t len = 0;
+        const char* dep_path = (dep_ref != CF_DB_NO_REF) ? cf_db_entry_path(db, dep_ref, &len) : NULL;
+        utd = (dep_path != NULL && len < sizeof(dep));
+        if (utd) {
+            memcpy(dep, dep_path, len);
+            dep[len] = '\0';
+        }
+        mtx_unlock(&db->lock);
+
+        uint64_t fingerprint[2];
+        utd = utd && cf_db_dep_fingerprint(db, dep, false, fingerprint);
+        if (utd) {
+            xxh64_update(&state, (const uint8_t*) fingerprint, sizeof(fingerprint));
+        }
+    }
+    free(deps);
+
+    return utd && xxh64_digest(&state) == entry.deps_hash;
+}
+
+/* Outputs of a tracked command are marked under its signature instead of the environment */
+static void cf_db_apply_mark(const cf_deferred_mark_t* mark, uint64_t env_hash) {
+    switch (mark->kind) {
+        case MARK_DEPFILE:
+            cf_db_mark_deps(mark->path, mark->arg, cf_db_get(), env_hash);
+            break;
+        case MARK_SCAN:
+            cf_db_mark_scan(mark->path, mark->arg, cf_db_get(), env_hash);
+            break;
+        case MARK_COMMAND:
+            for (size_t i = 0; i < mark->action->num_outputs; i++) {
+                cf_db_mark_prereqs(mark->action->outputs[i], mark->action->inputs, mark->action->num_inputs, cf_db_get(), mark->signature);
+            }
+            break;
+        default:
+            cf_db_mark_utd_env(mark->path, cf_db_get(), env_hash);
+            break;
+    }
+}
+
+static void cf_db_free_mark(cf_deferred_mark_t* mark) {
+    free(mark->path);
+    free(mark->arg);
+    free(mark->action);
+}
+
+/* Applies and frees marks whose jobs succeeded, called without global_workq->lock */
+static void cf_db_commit_marks(cf_deferred_mark_t* marks, size_t count, uint64_t env_hash) {
+    for (size_t i = 0; i < count; i++) {
+        cf_db_apply_mark(&marks[i], env_hash);
+        cf_db_free_mark(&marks[i]);
+    }
+    free(marks);
+}
+
+/* The mark waits until the target is done, see cf_finish_target() */
+static void cf_db_push_mark(cf_target_decl_t* target, cf_deferred_mark_t mark) {
+    /* After a failed CF_RUN(...) with -k, the outputs can't be trusted */
+    if (cf_body_failed) {
+        cf_db_free_mark(&mark);
+        return;
+    }
+
+    if (target->deferred_utd == NULL) {
+        target->deferred_utd = (cf_deferred_mark_t*) malloc(CF_MAX_DEFERRED_UTD * sizeof(cf_deferred_mark_t));
+        if (target->deferred_utd == NULL) {
+            CF_ERR_LOG("Error: malloc() failed in cf_db_push_mark()!\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+    }
+
+    if (target->num_deferred_utd >= CF_MAX_DEFERRED_UTD) {
+        CF_ERR_LOG("Error: Maximum deferred UTD marks reached!");
+        exit(CF_MAX_REACHED_EC);
+    }
+
+    target->deferred_utd[target->num_deferred_utd++] = mark;
+}
+
+/*
+ * The mark waits for job alone and is committed as soon as job is reaped,
+ * or once the body returns if job finished before. If job failed, it is
+ * dropped. CF_NO_JOB waits for nothing.
+ */
+static void cf_db_attach_mark(cf_target_decl_t* target, cf_deferred_mark_t mark, cf_job_node_t* job) {
+    if (job != NULL && !cf_body_failed) {
+        mtx_lock(&global_workq->lock);
+        bool failed = job->failed;
+        bool waits = !job->done && !failed;
+        if (waits) {
+            if (job->num_marks >= job->marks_cap) {
+                size_t ncap = (job->marks_cap == 0) ? 2 : job->marks_cap * 2;
+                cf_deferred_mark_t* nmarks = (cf_deferred_mark_t*) realloc(job->marks, ncap * sizeof(cf_deferred_mark_t));
+                if (nmarks == NULL) {
+                    CF_ERR_LOG("Error: realloc() failed in cf_db_attach_mark()\n");
+                    exit(CF_CLIB_FAIL_EC);
+                }
+
+                job->marks = nmarks;
+                job->marks_cap = ncap;
+            }
+
+            job->marks[job->num_marks++] = mark;
+            job->commit_marks = cf_db_commit_marks;
+        }
+        mtx_unlock(&global_workq->lock);
+
+        if (waits) {
+            return;
+        }
+
+        if (failed) {
+            cf_db_free_mark(&mark);
+            return;
+        }
+    }
+
+    mark.queued = 0;
+    cf_db_push_mark(target, mark);
+}
+
+/*
+ * Marks are applied once the jobs they wait for succeeded: with after, the
+ * job it points to, otherwise every job the target queued before the mark.
+ */
+static void cf_db_defer_mark(cf_mark_kind_t kind, char* path, const char* arg, cf_job_node_t* const* after) {
+    cf_target_decl_t* target = cf_cur_target;
+    if (target == NULL) {
+        cf_deferred_mark_t mark = {
+            .kind = kind,
+            .path = path,
+            .arg = (char*) arg,
+        };
+        cf_db_apply_mark(&mark, cenv_hash);
+        return;
+    }
+
+    /* Applied under the final env hash, which must include the tracked variables */
+    cf_env_hash();
+    cf_deferred_mark_t mark = {
+        .kind = kind,
+        .path = strdup(path),
+        .arg = (arg != NULL) ? strdup(arg) : NULL,
+        .queued = target->num_jobs,
+    };
+    if (mark.path == NULL || (arg != NULL && mark.arg == NULL)) {
+        CF_ERR_LOG("Error: strdup() failed in cf_db_defer_mark()!\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    if (after != NULL) {
+        cf_db_attach_mark(target, mark, *after);
+    } else {
+        cf_db_push_mark(target, mark);
+    }
+}
+
+/* Takes ownership of action, the mark waits for the command's own job */
+static void cf_db_defer_command(cf_action_t* action, uint64_t signature, cf_job_node_t* job) {
+    cf_deferred_mark_t mark = {
+        .kind = MARK_COMMAND,
+        .action = action,
+        .signature = signature,
+    };
+
+    if (cf_cur_target == NULL) {
+        cf_db_apply_mark(&mark, cenv_hash);
+        free(action);
+        return;
+    }
+
+    cf_db_attach_mark(cf_cur_target, mark, job);
+}
+
+__attribute__((unused)) static void cf_db_defer_mark_utd(char* path, cf_job_node_t* const* after) {
+    cf_db_defer_mark(MARK_UTD, path, NULL, after);
+}
+
+__attribute__((unused)) static void cf_db_defer_mark_deps(char* path, const char* depfile, cf_job_node_t* const* after) {
+    cf_db_defer_mark(MARK_DEPFILE, path, depfile, after);
+}
+
+__attribute__((unused)) static void cf_db_defer_mark_scan(char* path, const char* includes, cf_job_node_t* const* after) {
+    cf_db_defer_mark(MARK_SCAN, path, includes, after);
+}
+
+/* Safe to call from workers: the entry is copied out under the DB lock */
+static bool cf_file_utd_env(char* path, uint64_t env_hash) {
+    cf_db_mem_t* db = cf_db_get();
+    mtx_lock(&db->lock);
+    size_t ref = cf_db_lookup_env(db, path, strlen(path), env_hash);
+    cf_db_entry_t entry = { 0 };
+    if (ref != CF_DB_NO_REF) {
+        entry = *cf_db_entry_at(db, ref);
+    }
+    mtx_unlock(&db->lock);
+
+    if (ref == CF_DB_NO_REF) {
+        return false;
+    }
+
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        return false;
+    }
+
+    if (entry.size != (uint64_t) st.st_size) {
+        return false;
+    }
+
+    bool same_mtime = entry.mtime_sec == (uint64_t) st.st_mtim.tv_sec
+        && entry.mtime_nsec == (uint64_t) st.st_mtim.tv_nsec;
+
+#ifdef CF_DISABLE_FILE_HASH
+    return same_mtime && cf_db_deps_utd(db, ref);
+#else
+    if (same_mtime && !cf_db_is_racy(entry.mtime_sec, entry.mtime_nsec, entry.mark_sec, entry.mark_nsec)) {
+        return cf_db_deps_utd(db, ref);
+    }
+
+    /* Racy or touched: only the content can tell */
+    uint64_t hash = 0;
+    if (cf_db_hash_file(path, &hash) == false) {
+        return false;
+    }
+
+    if (hash != entry.content_hash) {
+        return false;
+    }
+
+    cf_db_refresh(db, ref, &st, hash);
+    return cf_db_deps_utd(db, ref);
+#endif // CF_DISABLE_FILE_HASH
+}
+
+__attribute__((unused)) static bool cf_file_utd(char* path) {
+    return cf_file_utd_env(path, cf_env_hash());
+}
+
+/*
+ * Outputs of a tracked command are up to date while they were marked under
+ * the same signature and none of its inputs, nor what the inputs were marked
+ * to depend on (CF_FILE_MARK_DEPS or CF_FILE_MARK_SCAN), changed since.
+ */
+static bool cf_command_utd(const cf_action_t* action, uint64_t signature) {
+    for (size_t i = 0; i < action->num_outputs; i++) {
+        if (!cf_file_utd_env(action->outputs[i], signature)) {
+            return false;
+        }
+    }
+
+    cf_db_mem_t* db = cf_db_get();
+    for (size_t i = 0; i < action->num_inputs; i++) {
+        mtx_lock(&db->lock);
+        size_t ref = cf_db_lookup_env(db, action->inputs[i], strlen(action->inputs[i]), action->env_hash);
+        mtx_unlock(&db->lock);
+
+        if (ref != CF_DB_NO_REF && !cf_db_deps_utd(db, ref)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* One block holding the action and copies of its paths, which the body may free */
+static cf_action_t* cf_action_new(const char* const* inputs, size_t num_inputs, const char* const* outputs, size_t num_outputs) {
+    size_t bytes = sizeof(cf_action_t) + (num_inputs + num_outputs) * sizeof(char*);
+    for (size_t i = 0; i < num_inputs; i++) {
+        bytes += strlen(inputs[i]) + 1;
+    }
+
+    for (size_t i = 0; i < num_outputs; i++) {
+        bytes += strlen(outputs[i]) + 1;
+    }
+
+    cf_action_t* action = (cf_action_t*) calloc(1, bytes);
+    if (action == NULL) {
+        CF_ERR_LOG("Error: calloc() failed in cf_action_new()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    action->inputs = (char**) (action + 1);
+    action->outputs = action->inputs + num_inputs;
+    action->num_inputs = num_inputs;
+    action->num_outputs = num_outputs;
+    action->env_hash = cf_env_hash();
+
+    char* cursor = (char*) (action->outputs + num_outputs);
+    for (size_t i = 0; i < num_inputs + num_outputs; i++) {
+        const char* path = (i < num_inputs) ? inputs[i] : outputs[i - num_inputs];
+        size_t len = strlen(path) + 1;
+        memcpy(cursor, path, len);
+        action->inputs[i] = cursor;
+        cursor += len;
+    }
+
+    return action;
+}
+
+/*
+ * Like cf_internal_runner(), but the outputs are restored from the action
+ * cache instead when the same command already ran on the same inputs.
+ */
+__attribute__((format(printf, 6, 7)))
+__attribute__((unused))
+static cf_job_t cf_cached_runner(bool parallel, const char* const* inputs, size_t num_inputs, const char* const* outputs, size_t num_outputs, const char* format_str, ...) {
+    va_list args;
+    va_start(args, format_str);
+    char* buffer = cf_format_command(format_str, args);
+    va_end(args);
+
+    cf_action_t* action = cf_action_new(inputs, num_inputs, outputs, num_outputs);
+    return cf_execute_command(parallel, buffer, NULL, 0, action);
+}
+
+/*
+ * Like cf_internal_runner(), but the command only runs if its command line
+ * differs from the one the outputs were built with, or an output or input
+ * changed. Only the formatted command is hashed, so the environment does not
+ * invalidate it. Returns CF_NO_JOB when the command was skipped.
+ */
+__attribute__((format(printf, 6, 7)))
+__attribute__((unused))
+static cf_job_t cf_tracked_runner(bool parallel, const char* const* inputs, size_t num_inputs, const char* const* outputs, size_t num_outputs, const char* format_str, ...) {
+    va_list args;
+    va_start(args, format_str);
+    char* buffer = cf_format_command(format_str, args);
+    va_end(args);
+
+    uint64_t signature = cf_wh((const uint8_t*) buffer, strlen(buffer), CF_SIGNATURE_SEED);
+    cf_action_t* action = cf_action_new(inputs, num_inputs, outputs, num_outputs);
+    if (cf_command_utd(action, signature)) {
+        free(action);
+        free(buffer);
+        return NULL;
+    }
+
+    cf_job_t job = cf_execute_command(parallel, buffer, NULL, 0, NULL);
+    cf_db_defer_command(action, signature, job);
+    return job;
+}
+
+/* Shared between the caller and the pool jobs, freed by whoever leaves last */
+typedef struct {
+    char** paths;
+    bool* utd;
+    size_t count;
+    uint64_t env_hash;
+    size_t chunk;
+    size_t next;
+    size_t chunks_left;
+    size_t refs;
+    mtx_t lock;
+    cnd_t done;
+} cf_utd_batch_t;
+
+static void cf_utd_batch_drain(cf_utd_batch_t* batch) {
+    mtx_lock(&batch->lock);
+    while (batch->next < batch->count) {
+        size_t start = batch->next;
+        size_t end = (start + batch->chunk < batch->count) ? start + batch->chunk : batch->count;
+        batch->next = end;
+        mtx_unlock(&batch->lock);
+
+        for (size_t i = start; i < end; i++) {
+            batch->utd[i] = cf_file_utd_env(batch->paths[i], batch->env_hash);
+        }
+
+        mtx_lock(&batch->lock);
+        if (--batch->chunks_left == 0) {
+            cnd_signal(&batch->done);
+        }
+    }
+    mtx_unlock(&batch->lock);
+}
+
+static void cf_utd_batch_release(cf_utd_batch_t* batch) {
+    mtx_lock(&batch->lock);
+    bool last = (--batch->refs == 0);
+    mtx_unlock(&batch->lock);
+
+    if (last) {
+        mtx_destroy(&batch->lock);
+        cnd_destroy(&batch->done);
+        free(batch);
+    }
+}
+
+static void cf_utd_batch_job(void* arg) {
+    cf_utd_batch_t* batch = (cf_utd_batch_t*) arg;
+    cf_utd_batch_drain(batch);
+    cf_utd_batch_release(batch);
+}
+
+static void* cf_utd_batch_track(size_t size) {
+    if (cf_num_utd_batches >= CF_MAX_UTD_BATCHES) {
+        CF_ERR_LOG("Error: Maximum UTD batches of %d was reached!\n", CF_MAX_UTD_BATCHES);
+        exit(CF_MAX_REACHED_EC);
+    }
+
+    void* block = malloc(size > 0 ? size : 1);
+    if (block == NULL) {
+        CF_ERR_LOG("Error: malloc() failed in cf_utd_batch_track()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    cf_utd_batches[cf_num_utd_batches++] = block;
+    return block;
+}
+
+/*
+ * Checks every path and returns a per-path UTD flag array. Stats and hashes
+ * are spread over the worker pool in chunks; the caller drains chunks too,
+ * so queued CF_RUNP jobs ahead of the batch can't stall it.
+ */
+__attribute__((unused)) static bool* cf_files_utd(char** paths, size_t count) {
+    bool* utd = (bool*) cf_utd_batch_track(count * sizeof(bool));
+    uint64_t env_hash = cf_env_hash();
+    cf_db_get();
+
+    size_t chunk = count / (cf_max_jobs * 4);
+    if (chunk < CF_MIN_UTD_BATCH_CHUNK) {
+        chunk = CF_MIN_UTD_BATCH_CHUNK;
+    }
+
+    size_t nchunks = (count + chunk - 1) / chunk;
+    if (nchunks <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            utd[i] = cf_file_utd_env(paths[i], env_hash);
+        }
+
+        return utd;
+    }
+
+    cf_utd_batch_t* batch = (cf_utd_batch_t*) malloc(sizeof(cf_utd_batch_t));
+    if (batch == NULL) {
+        CF_ERR_LOG("Error: malloc() failed in cf_files_utd()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    size_t njobs = (nchunks - 1 < cf_max_jobs) ? nchunks - 1 : cf_max_jobs;
+    *batch = (cf_utd_batch_t) {
+        .paths = paths,
+        .utd = utd,
+        .count = count,
+        .env_hash = env_hash,
+        .chunk = chunk,
+        .next = 0,
+        .chunks_left = nchunks,
+        .refs = njobs + 1,
+    };
+
+    if (mtx_init(&batch->lock, mtx_plain) != thrd_success || cnd_init(&batch->done) != thrd_success) {
+        CF_ERR_LOG("Error: Could not initialize batch in cf_files_utd()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+
+    for (size_t i = 0; i < njobs; i++) {
+        cf_submit_job((cf_thrd_job) {
+            .fn = cf_utd_batch_job,
+            .arg = batch,
+        }, NULL, 0);
+    }
+
+    cf_utd_batch_drain(batch);
+    mtx_lock(&batch->lock);
+    while (batch->chunks_left > 0) {
+        cnd_wait(&batch->done, &batch->lock);
+    }
+    mtx_unlock(&batch->lock);
+
+    cf_utd_batch_release(batch);
+    return utd;
+}
+
+__attribute__((unused)) static cf_glob_t cf_files_stale(char** paths, size_t count) {
+    bool* utd = cf_files_utd(paths, count);
+    char** stale = (char**) cf_utd_batch_track(count * sizeof(char*));
+    size_t nstale = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!utd[i]) {
+            stale[nstale++] = paths[i];
+        }
     }
 
-    entry->mtime_sec = (uint64_t) st.st_mtim.tv_sec;
-    entry->mtime_nsec = (uint64_t) st.st_mtim.tv_nsec;
-    entry->size = (uint64_t) st.st_size;
-    entry->env_hash = cenv_hash;
-    entry->content_hash = hash;
+    return (cf_glob_t) {
+        .c = nstale,
+        .p = (nstale > 0) ? stale : NULL,
+    };
 }
 
-__attribute__((unused)) static void cf_db_defer_mark_utd(char* path) {
-    if (cf_num_deferred_utd >= CF_MAX_DEFERRED_UTD) {
-        CF_ERR_LOG("Error: Maximum deferred UTD marks reached!");
-        exit(CF_MAX_REACHED_EC);
-    }
+/* Takes the glob by value, so CF_GLOB_STALE(CF_GLOB(...)) globs only once */
+__attribute__((unused)) static cf_glob_t cf_glob_stale(cf_glob_t glob) {
+    return cf_files_stale(glob.p, glob.c);
+}
 
-    char* ptr = strdup(path);
-    if (ptr == NULL) {
-        CF_ERR_LOG("Error: strdup() failed in cf_db_defer_mark_utd()!\n");
-        exit(CF_CLIB_FAIL_EC);
+static void cf_free_utd_batches(size_t checkpoint) {
+    while (cf_num_utd_batches > checkpoint) {
+        free(cf_utd_batches[--cf_num_utd_batches]);
+        cf_utd_batches[cf_num_utd_batches] = NULL;
     }
-
-    cf_deferred_utd[cf_num_deferred_utd++] = ptr;
 }
 
-__attribute__((unused)) static bool cf_file_utd(char* path) {
-    cf_db_entry_t* entry = cf_db_find(path, global_db);
-    if (entry == NULL) {
-        return false;
+/* Remembers which variables the target read, the DB is only touched if that changed */
+static void cf_env_save_deps(cf_target_decl_t* target, size_t checkpoint) {
+    uint64_t vars[CF_MAX_ENVS];
+    size_t count = 0;
+    for (size_t i = checkpoint; i < cf_num_env_deps; i++) {
+        if (cf_env_deps[i].kind == ENV_DEP_READ) {
+            char key[PATH_MAX];
+            size_t key_len = cf_env_db_key(key, sizeof(key), 'V', cf_env_deps[i].name);
+            if (key_len > 0) {
+                vars[count++] = cf_wh((const uint8_t*) key, key_len, 0);
+            }
+        }
     }
 
-    struct stat st;
-    if (stat(path, &st) == -1) {
-        return false;
+    /* Nothing was checked or marked under cenv_hash if the body never used the DB */
+    if (!cf_env_deps_loaded || (count == 0 && global_db == NULL && access(CF_DB_PATH, F_OK) != 0)) {
+        return;
     }
 
-    if (entry->size != (uint64_t) st.st_size) {
-        return false;
+    char key[CF_MAX_NAME_LENGTH + 3];
+    size_t key_len = cf_env_db_key(key, sizeof(key), 'T', target->name);
+    cf_db_mem_t* db = cf_db_get();
+
+    mtx_lock(&db->lock);
+    size_t ref = cf_db_lookup(db, key, key_len);
+    if (ref != CF_DB_NO_REF) {
+        const cf_db_entry_t* entry = cf_db_entry_at(db, ref);
+        if (entry->deps_cnt == count && (count == 0 || memcmp(cf_db_entry_deps(db, entry), vars, count * sizeof(uint64_t)) == 0)) {
+            mtx_unlock(&db->lock);
+            return;
+        }
+    } else if (count == 0) {
+        mtx_unlock(&db->lock);
+        return;
     }
 
-    if (entry->mtime_nsec != (uint64_t) st.st_mtim.tv_nsec) {
-        return false;
+    for (size_t i = checkpoint; i < cf_num_env_deps; i++) {
+        char var_key[PATH_MAX];
+        size_t var_len = cf_env_db_key(var_key, sizeof(var_key), 'V', cf_env_deps[i].name);
+        if (cf_env_deps[i].kind == ENV_DEP_READ && var_len > 0 && cf_db_lookup(db, var_key, var_len) == CF_DB_NO_REF) {
+            cf_db_mark_dirty(db, cf_db_append(db, var_key, var_len));
+        }
     }
 
-    if (entry->mtime_sec != (uint64_t) st.st_mtim.tv_sec) {
-        return false;
+    if (ref == CF_DB_NO_REF) {
+        ref = cf_db_append(db, key, key_len);
     }
+    cf_db_set_deps(db, ref, vars, count, 0);
+    cf_db_mark_dirty(db, ref);
+    mtx_unlock(&db->lock);
+}
 
-    if (cenv_hash != entry->env_hash) {
-        return false;
+static cf_config_decl_t* cf_find_config(const char* conf_name) {
+    for (size_t c_idx = 0; c_idx < cf_num_configs; c_idx++) {
+        if (strncmp(conf_name, cf_configs[c_idx].name, CF_MAX_NAME_LENGTH) == 0) {
+            return &cf_configs[c_idx];
+        }
     }
 
-    /* TODO: Optimize the above so that this never has to run */
-    uint64_t hash = 0;
-    if (cf_db_hash_file(path, &hash) == false) {
-        return false;
+    CF_ERR_LOG("Error: Config \"%s\" not found!\n", conf_name);
+    exit(CF_NOT_FOUND_EC);
+}
+
+/*
+ * A target runs once per config it is built with. The registered target
+ * takes the first config it is reached with, every other config gets an
+ * instance sharing its attributes and body, but with its own state. This
+ * lets `./cforge.h debug release` build both variants in one schedule.
+ */
+static cf_target_decl_t* cf_target_instance(cf_target_decl_t* target, cf_config_decl_t* inherited_config) {
+    cf_config_decl_t* config = inherited_config;
+    for (size_t i = 0; i < target->attribs_size; i++) {
+        if (target->attribs[i].type == CONFIG_SET) {
+            config = cf_find_config(target->attribs[i].arg.configset.config_name);
+            break;
+        }
     }
 
-    if (hash != entry->content_hash) {
-        return false;
+    if (target->node_status == UNVISITED) {
+        target->config = config;
+        return target;
     }
 
-    return true;
-}
+    for (size_t i = 0; i < cf_num_targets; i++) {
+        cf_target_decl_t* instance = &cf_targets[i];
+        if ((instance == target || instance->base == target) && instance->config == config) {
+            return instance;
+        }
+    }
 
-static inline uint64_t cf_hash_env(char** env) {
-    uint64_t hash = 0;
-    for (char** entry = env; *entry != NULL; entry++) {
-        size_t len = strlen(*entry);
-        hash ^= xxh64((uint8_t*) *entry, len, 0);
+    if (cf_num_targets >= CF_MAX_TARGETS) {
+        CF_ERR_LOG("Error: Maximum targets of %d was reached!\n", CF_MAX_TARGETS);
+        exit(CF_MAX_REACHED_EC);
     }
 
-    return hash;
+    cf_targets[cf_num_targets] = (cf_target_decl_t) {
+        .name = target->name,
+        .fn = target->fn,
+        .attribs = target->attribs,
+        .attribs_size = target->attribs_size,
+        .node_status = UNVISITED,
+        .config = config,
+        .base = target
+    };
+    return &cf_targets[cf_num_targets++];
 }
 
-static void cf_dfs_execute(cf_target_decl_t* target, cf_config_decl_t* inherited_config) {
-    if (target->node_status == DONE) {
+/*
+ * Resolves the subgraph below target, whose config cf_target_instance()
+ * fixed: validates attributes, detects cycles, resolves dependencies to the
+ * instances for that config and appends them in dependency post-order.
+ */
+static void cf_dfs_plan(cf_target_decl_t* target, cf_target_decl_t** order, size_t* order_size) {
+    if (target->node_status == PLANNED || target->node_status == DONE) {
         return;
     } else if (target->node_status == VISITING) {
         CF_ERR_LOG("Error: Dependency cycle detected for \"%s\"\n", target->name);
@@ -1614,7 +6863,15 @@ static void cf_dfs_execute(cf_target_decl_t* target, cf_config_decl_t* inherited
     }
 
     target->node_status = VISITING;
-    cf_config_decl_t* config = NULL;
+    if (target->attribs_size > 0) {
+        target->deps = (cf_target_decl_t**) malloc(target->attribs_size * sizeof(cf_target_decl_t*));
+        if (target->deps == NULL) {
+            CF_ERR_LOG("Error: malloc() failed in cf_dfs_plan()\n");
+            exit(CF_CLIB_FAIL_EC);
+        }
+    }
+
+    bool config_seen = false;
     bool dep_ran = false;
 
     for (size_t i = 0; i < target->attribs_size; i++) {
@@ -1629,11 +6886,13 @@ static void cf_dfs_execute(cf_target_decl_t* target, cf_config_decl_t* inherited
                 }
 
                 dep_ran = true;
-                cf_dfs_execute(&cf_targets[dep_idx], (config == NULL) ? inherited_config : config);
+                cf_target_decl_t* dep = cf_target_instance(&cf_targets[dep_idx], target->config);
+                target->deps[target->num_deps++] = dep;
+                cf_dfs_plan(dep, order, order_size);
                 break;
             }
             case CONFIG_SET: {
-                if (config != NULL) {
+                if (config_seen) {
                     CF_WRN_LOG("Warning: Cannot set two or more configs per target. Ignoring...\n");
                     goto next_attr;
                 }
@@ -1642,28 +6901,11 @@ static void cf_dfs_execute(cf_target_decl_t* target, cf_config_decl_t* inherited
                     CF_ERR_LOG("Error: Config attribute(s) specified later than first dependency attribute in target\"%s\"!\n", target->name);
                     exit(CF_INVALID_STATE_EC);
                 }
-                
-                const char* conf_name = attrib->arg.configset.config_name;
-                for (size_t c_idx = 0; c_idx < cf_num_configs; c_idx++) {
-                    if (strncmp(conf_name, cf_configs[c_idx].name, CF_MAX_NAME_LENGTH) == 0) {
-                        config = &cf_configs[c_idx];
-                        goto next_attr;
-                    }
-                }
-                
-                CF_ERR_LOG("Error: Config \"%s\" not found!\n", conf_name);
-                exit(CF_NOT_FOUND_EC);
-                break;
-            }
-            case VERBOSE: {
-                if (is_verbose_target) {
-                    CF_WRN_LOG("Warning: VERBOSE attribute passed to target \"%s\" multiple times!\n", target->name);
-                    break;
-                }
 
-                is_verbose_target = true;
+                config_seen = true;
                 break;
             }
+            case VERBOSE:
             case HELP_STRING:
             case HIDDEN:
                 goto next_attr;
@@ -1677,54 +6919,380 @@ next_attr:
         continue;
     }
 
-    size_t env_checkpoint = cf_num_envs;
-    if (config != NULL) {
-        config->fn();
-        cenv_hash = cf_hash_env(environ);
-    } else if (inherited_config != NULL) {
-        inherited_config->fn();
-        cenv_hash = cf_hash_env(environ);
-    } else {
-        /* Commands in system() can't change parent environment! */
-        cenv_hash = denv_hash;
+    target->node_status = PLANNED;
+    order[(*order_size)++] = target;
+}
+
+static bool cf_deps_failed(cf_target_decl_t* target) {
+    for (size_t i = 0; i < target->num_deps; i++) {
+        if (target->deps[i]->node_status == FAILED) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool cf_deps_done(cf_target_decl_t* target) {
+    for (size_t i = 0; i < target->num_deps; i++) {
+        if (target->deps[i]->node_status != DONE) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * The body returned and env_hash is final: commits the marks of the jobs
+ * that succeeded meanwhile, workers commit the rest as they reap the jobs.
+ */
+static void cf_commit_body_marks(cf_target_decl_t* target) {
+    cf_deferred_mark_t* marks = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    mtx_lock(&global_workq->lock);
+    target->body_done = true;
+    for (cf_job_node_t* node = target->jobs; node != NULL; node = node->next_owned) {
+        if (!node->done || node->num_marks == 0) {
+            continue;
+        }
+
+        if (count + node->num_marks > cap) {
+            cap = (count + node->num_marks) * 2;
+            cf_deferred_mark_t* nmarks = (cf_deferred_mark_t*) realloc(marks, cap * sizeof(cf_deferred_mark_t));
+            if (nmarks == NULL) {
+                CF_ERR_LOG("Error: realloc() failed in cf_commit_body_marks()\n");
+                exit(CF_CLIB_FAIL_EC);
+            }
+            marks = nmarks;
+        }
+
+        memcpy(marks + count, node->marks, node->num_marks * sizeof(cf_deferred_mark_t));
+        count += node->num_marks;
+        free(node->marks);
+        node->marks = NULL;
+        node->num_marks = 0;
+        node->marks_cap = 0;
+    }
+    mtx_unlock(&global_workq->lock);
+
+    cf_db_commit_marks(marks, count, target->env_hash);
+}
+
+/* Marks of the target waiting for all jobs before them are kept while queued is at most this */
+static size_t cf_first_unfinished_job(const cf_target_decl_t* target) {
+    size_t first = SIZE_MAX;
+    for (const cf_job_node_t* node = target->jobs; node != NULL; node = node->next_owned) {
+        if (!node->done && node->seq < first) {
+            first = node->seq;
+        }
+    }
+
+    return first;
+}
+
+/* Runs the body on the main thread; its CF_RUNP jobs keep running afterwards */
+static void cf_run_target(cf_target_decl_t* target) {
+    for (size_t i = 0; i < target->attribs_size; i++) {
+        if (target->attribs[i].type != VERBOSE) {
+            continue;
+        }
+
+        if (is_verbose_target) {
+            CF_WRN_LOG("Warning: VERBOSE attribute passed to target \"%s\" multiple times!\n", target->name);
+            break;
+        }
+
+        is_verbose_target = true;
     }
 
+    target->node_status = RUNNING;
+    target->pending = 1;
+    cf_cur_target = target;
+
+    size_t env_checkpoint = cf_num_envs;
+    size_t env_deps_checkpoint = cf_num_env_deps;
+    if (target->config != NULL) {
+        target->config->fn();
+    }
+    cf_env_deps_loaded = false;
+    cf_env_frozen = true;
 
     size_t glob_checkpoint = cf_num_globs;
     size_t jstrings_checkpoint = cf_num_jstrings;
     size_t splits_checkpoint = cf_num_splits;
     size_t maps_checkpoint = cf_num_maps;
+    size_t utd_batches_checkpoint = cf_num_utd_batches;
     size_t fstrings_checkpoint = cf_num_fstrings;
+    size_t groups_checkpoint = cf_num_groups;
     target->fn();
 
-    mtx_t* lock = &global_workq->lock;
-    mtx_lock(lock);
-    while (global_workq->active_jobs > 0 || !cf_empty_job()) {
-        cnd_wait(&global_workq->no_job, lock);
-    }
-    mtx_unlock(lock);
-
-    for (size_t i = 0; i < cf_num_deferred_utd; i++) {
-        cf_db_mark_utd(cf_deferred_utd[i], global_db);
-        free(cf_deferred_utd[i]);
-    }
-    cf_num_deferred_utd = 0;
+    /* Variables first read in the body count too, the next run tracks them from the start */
+    target->env_hash = cenv_hash;
+    cf_env_save_deps(target, env_deps_checkpoint);
+    cf_env_frozen = false;
+    cf_commit_body_marks(target);
 
+    cf_free_groups(groups_checkpoint);
     cf_free_fstrings(fstrings_checkpoint);
+    cf_free_utd_batches(utd_batches_checkpoint);
     cf_free_maps(maps_checkpoint);
     cf_free_splits(splits_checkpoint);
     cf_free_jstrings(jstrings_checkpoint);
     cf_free_glob(glob_checkpoint);
     cf_restore_env(env_checkpoint);
+    cf_env_untrack(env_deps_checkpoint);
 
+    /* The body may have touched environ directly, don't reuse its snapshot */
+    cf_env_invalidate();
+    cf_cur_target = NULL;
+    cf_body_failed = false;
     is_verbose_target = false;
 
-    target->node_status = DONE;
+    mtx_lock(&global_workq->lock);
+    --target->pending;
+    mtx_unlock(&global_workq->lock);
+}
+
+/*
+ * Runs at exit while targets are executing. After a failed command or
+ * SIGINT/SIGTERM, the commands still running are stopped. Each mark of an
+ * unfinished target is committed if the command it belongs to succeeded,
+ * then the DB is saved, so the next run resumes from there.
+ */
+static void cf_flush_on_exit(void) {
+    if (!cf_build_running || !thrd_equal(thrd_current(), cf_main_thrd)) {
+        return;
+    }
+
+    mtx_t* lock = &global_workq->lock;
+    mtx_lock(lock);
+    if (!global_workq->failed) {
+        mtx_unlock(lock);
+        return;
+    }
+
+    while (global_workq->running_jobs > 0) {
+        cnd_wait(&global_workq->no_job, lock);
+    }
+    int32_t sig = global_workq->signal;
+    mtx_unlock(lock);
+
+    for (size_t i = 0; i < cf_num_targets; i++) {
+        cf_target_decl_t* target = &cf_targets[i];
+        if (target->node_status != RUNNING) {
+            continue;
+        }
+
+        /* The body of cf_cur_target was cut short, its hash is still in cenv_hash */
+        uint64_t env_hash = (target == cf_cur_target) ? cenv_hash : target->env_hash;
+        size_t first_unfinished = cf_first_unfinished_job(target);
+        for (size_t j = 0; j < target->num_deferred_utd; j++) {
+            cf_deferred_mark_t* mark = &target->deferred_utd[j];
+            if (mark->queued <= first_unfinished) {
+                cf_db_apply_mark(mark, env_hash);
+            }
+        }
+
+        /* Workers commit the marks of a job only once its body returned */
+        for (cf_job_node_t* node = target->jobs; node != NULL && !target->body_done; node = node->next_owned) {
+            for (size_t j = 0; j < node->num_marks && node->done; j++) {
+                cf_db_apply_mark(&node->marks[j], env_hash);
+            }
+        }
+    }
+
+    cf_db_save_global();
+
+    /* Outputs of the actions that succeeded are still worth sharing, unless interrupted */
+    if (sig == 0) {
+        cf_remote_teardown();
+    }
+
+    /* Dying by the signal tells a parent make or shell the build was interrupted */
+    if (sig != 0) {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, sig);
+        cf_jobserver_return_held();
+        fflush(NULL);
+        signal(sig, SIG_DFL);
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+        raise(sig);
+    }
+}
+
+/*
+ * SIGINT and SIGTERM are blocked in every thread and taken here instead,
+ * so the main thread stops the build at its next wait like after a failed
+ * command. A second signal kills the running commands and terminates right
+ * away.
+ */
+static int cf_signal_thrd(void* arg) {
+    const sigset_t* set = (const sigset_t*) arg;
+    while (true) {
+        int sig = 0;
+        if (sigwait(set, &sig) != 0) {
+            continue;
+        }
+
+        mtx_lock(&global_workq->lock);
+        bool again = (global_workq->signal != 0);
+        global_workq->signal = sig;
+        global_workq->failed = true;
+        cnd_broadcast(&global_workq->target_done);
+        cnd_broadcast(&global_workq->no_job);
+        cnd_broadcast(&global_workq->free_slot);
+        mtx_unlock(&global_workq->lock);
+
+        if (again) {
+            cf_cancel_children(true);
+            cf_db_save_dying();
+            cf_jobserver_return_held();
+            sigset_t self;
+            sigemptyset(&self);
+            sigaddset(&self, sig);
+            signal(sig, SIG_DFL);
+            pthread_sigmask(SIG_UNBLOCK, &self, NULL);
+            raise(sig);
+        }
+
+        cf_cancel_children(false);
+        CF_WRN_LOG("Warning: Received %s, stopping running commands...\n", strsignal(sig));
+    }
+
+    return 0;
+}
+
+static void cf_finish_target(cf_target_decl_t* target) {
+    /* A failed target only keeps the marks whose jobs all succeeded */
+    size_t first_unfinished = cf_first_unfinished_job(target);
+    for (size_t i = 0; i < target->num_deferred_utd; i++) {
+        cf_deferred_mark_t* mark = &target->deferred_utd[i];
+        if (mark->queued <= first_unfinished) {
+            cf_db_apply_mark(mark, target->env_hash);
+        }
+        cf_db_free_mark(mark);
+    }
+    free(target->deferred_utd);
+    target->deferred_utd = NULL;
+    target->num_deferred_utd = 0;
+
+    cf_free_job_nodes(target->jobs);
+    target->jobs = NULL;
+
+    target->node_status = target->failed ? FAILED : DONE;
+}
+
+/*
+ * Roots given one after another on the command line run in that order, so
+ * `clean build` cleans first. A root only joins the phase of the previous
+ * one if both select a config of their own and the configs differ: then they
+ * build config instances of the same graph, e.g. `release debug`.
+ */
+static bool cf_root_joins_phase(const cf_target_decl_t* prev, const cf_target_decl_t* root) {
+    /* A root has a config only if it selects one itself */
+    return prev->config != NULL && root->config != NULL && prev->config != root->config;
+}
+
+/*
+ * Executes the planned targets in one schedule. A target starts once all of
+ * its dependencies are done, i.e. their bodies returned and their jobs
+ * finished, and every target of an earlier phase is done. Jobs of independent
+ * targets overlap instead of the pool draining at every target boundary.
+ * Bodies still run one at a time on the main thread, each between applying
+ * and restoring its config, while queued jobs keep the environment snapshot
+ * they were submitted with; so variants of the same graph share the pool
+ * safely.
+ */
+static void cf_dfs_execute(cf_target_decl_t** order, size_t order_size) {
+    mtx_t* lock = &global_workq->lock;
+    size_t done = 0;
+    while (done < order_size) {
+        cf_target_decl_t* finished = NULL;
+        cf_target_decl_t* ready = NULL;
+
+        mtx_lock(lock);
+        while (finished == NULL && ready == NULL && done < order_size) {
+            /* Phases run in order, the order array lists them in ascending order */
+            size_t phase = SIZE_MAX;
+            for (size_t i = 0; i < order_size && phase == SIZE_MAX; i++) {
+                if (order[i]->node_status == PLANNED || order[i]->node_status == RUNNING) {
+                    phase = order[i]->phase;
+                }
+            }
+
+            for (size_t i = 0; i < order_size && finished == NULL; i++) {
+                cf_target_decl_t* t = order[i];
+                if (t->node_status == RUNNING && t->pending == 0) {
+                    finished = t;
+                } else if (t->node_status == PLANNED && cf_deps_failed(t)) {
+                    /* With -k, whatever depends on a failed target is skipped */
+                    t->node_status = FAILED;
+                    done++;
+                } else if (ready == NULL && t->node_status == PLANNED && t->phase == phase && cf_deps_done(t)) {
+                    ready = t;
+                }
+            }
+
+            if (global_workq->failed) {
+                cf_abort_build();
+            }
+
+            if (finished == NULL && ready == NULL && done < order_size) {
+                cnd_wait(&global_workq->target_done, lock);
+            }
+        }
+        mtx_unlock(lock);
+
+        /* Completing first may unblock targets ahead of ready in the order */
+        if (finished != NULL) {
+            cf_finish_target(finished);
+            done++;
+        } else if (ready != NULL) {
+            cf_run_target(ready);
+        }
+    }
+}
+
+/* With -k, lists every failed command and the targets skipped because of them */
+static void cf_report_failures(cf_target_decl_t** order, size_t order_size) {
+    if (cf_num_failures == 0) {
+        return;
+    }
+
+    CF_ERR_LOG("\nError: %zu command(s) failed:\n", cf_num_failures);
+    for (size_t i = 0; i < cf_num_failures; i++) {
+        CF_ERR_LOG("  [%s] %s\n", (cf_failures[i].target != NULL) ? cf_failures[i].target : "-", cf_failures[i].command);
+        free(cf_failures[i].command);
+    }
+    free(cf_failures);
+
+    bool skipped = false;
+    for (size_t i = 0; i < order_size; i++) {
+        if (order[i]->node_status == FAILED && !order[i]->failed) {
+            CF_ERR_LOG("%s%s", skipped ? ", " : "Skipped targets: ", order[i]->name);
+            skipped = true;
+        }
+    }
+
+    if (skipped) {
+        CF_ERR_LOG("\n");
+    }
 }
 
 static inline void cf_usage(void) {
     printf(
-        "\ncforge.h - v%d.%d.%d\n\nUsage:\n ./cforge.h <target> [...]\n\nAvailable targets:\n",
+        "\ncforge.h - v%d.%d.%d\n\nUsage:\n ./cforge.h [options] <target> [...]\n\n"
+        "Options:\n"
+        " -j N, --jobs=N            run at most N jobs at once (default: $CF_JOBS or the usable CPU count)\n"
+        " -k, --keep-going          after a failed command, keep building what does not depend on it\n"
+        " -l N, --load-average=N    hold back parallel jobs while the load average is at least N\n"
+        " --min-free-mem=SIZE       hold back parallel jobs while less than SIZE (K, M, G) memory is available\n"
+        " --remote-cache=URL        share the action cache with an HTTP cache server (default: $CF_REMOTE_CACHE)\n"
+        " --timeout=SECONDS         stop any command running longer than SECONDS (default: $CF_TIMEOUT, 0 disables)\n\n"
+        "Available targets:\n",
         CF_VERSION_MAJOR,
         CF_VERSION_MINOR,
         CF_VERSION_PATCH
@@ -1767,70 +7335,96 @@ __attribute__((weak)) int main(int argc, char** argv) {
     (void) cf_glob;
     (void) cf_join;
 
-    if (argc == 1) {
+    const char* jobs_arg = NULL;
+    const char* remote_arg = getenv("CF_REMOTE_CACHE");
+    const char* timeout_arg = NULL;
+    int32_t num_target_args = 0;
+    for (int32_t i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) {
+            if (i + 1 >= argc) {
+                CF_ERR_LOG("Error: Option \"%s\" needs a job count!\n", argv[i]);
+                return CF_INVALID_ARG_EC;
+            }
+
+            jobs_arg = argv[++i];
+        } else if (strncmp(argv[i], "-j", 2) == 0) {
+            jobs_arg = argv[i] + 2;
+        } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            jobs_arg = argv[i] + 7;
+        } else if (strcmp(argv[i], "-k") == 0 || strcmp(argv[i], "--keep-going") == 0) {
+            cf_keep_going = true;
+        } else if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--load-average") == 0) {
+            if (i + 1 >= argc) {
+                CF_ERR_LOG("Error: Option \"%s\" needs a load average!\n", argv[i]);
+                return CF_INVALID_ARG_EC;
+            }
+
+            cf_max_load = cf_parse_load(argv[++i]);
+        } else if (strncmp(argv[i], "-l", 2) == 0) {
+            cf_max_load = cf_parse_load(argv[i] + 2);
+        } else if (strncmp(argv[i], "--load-average=", 15) == 0) {
+            cf_max_load = cf_parse_load(argv[i] + 15);
+        } else if (strcmp(argv[i], "--min-free-mem") == 0) {
+            if (i + 1 >= argc) {
+                CF_ERR_LOG("Error: Option \"%s\" needs a memory size!\n", argv[i]);
+                return CF_INVALID_ARG_EC;
+            }
+
+            cf_min_free_mem = cf_parse_mem(argv[++i]);
+        } else if (strncmp(argv[i], "--min-free-mem=", 15) == 0) {
+            cf_min_free_mem = cf_parse_mem(argv[i] + 15);
+        } else if (strcmp(argv[i], "--remote-cache") == 0) {
+            if (i + 1 >= argc) {
+                CF_ERR_LOG("Error: Option \"%s\" needs a URL!\n", argv[i]);
+                return CF_INVALID_ARG_EC;
+            }
+
+            remote_arg = argv[++i];
+        } else if (strncmp(argv[i], "--remote-cache=", 15) == 0) {
+            remote_arg = argv[i] + 15;
+        } else if (strcmp(argv[i], "--timeout") == 0) {
+            if (i + 1 >= argc) {
+                CF_ERR_LOG("Error: Option \"%s\" needs a number of seconds!\n", argv[i]);
+                return CF_INVALID_ARG_EC;
+            }
+
+            timeout_arg = argv[++i];
+        } else if (strncmp(argv[i], "--timeout=", 10) == 0) {
+            timeout_arg = argv[i] + 10;
+        } else if (argv[i][0] == '-') {
+            CF_ERR_LOG("Error: Unknown option \"%s\"!\n", argv[i]);
+            return CF_INVALID_ARG_EC;
+        } else {
+            argv[1 + num_target_args++] = argv[i];
+        }
+    }
+
+    if (num_target_args == 0) {
         cf_usage();
         goto cleanup;
     }
 
-    global_db = cf_db_load(".cforge.db");
-
-#ifndef CF_DISABLE_ENV_AUTOMASK
-    static const char* const cf_automask_env[] = {
-        "SHLVL",
-        "COLORTERM",
-        "TERM_PROGRAM",
-        "TERM_PROGRAM_VERSION",
-
-        "SSH_CONNECTION",
-        "SSH_CLIENT",
-        "SSH_AUTH_SOCK",
-        "SSH_AGENT_PID",
-
-        "PID",
-        "PPID",
-        "OLDPWD",
-        "_",
-
-        "XDG_CURRENT_DESKTOP",
-        "XDG_SESSION_DESKTOP",
-        "XDG_SESSION_ID",
-        "XDG_RUNTIME_DIR",
-        "XDG_SESSION_TYPE",
-        "XDG_SEAT",
-        "XDG_VTNR",
-
-        "DBUS_SESSION_BUS_ADDRESS",
-        "SESSION_MANAGER",
-        "GDMSESSION",
-        "GNOME_DESKTOP_SESSION_ID",
-        "KDE_FULL_SESSION",
-        "KDE_SESSION_VERSION",
-        "KDE_SESSION_UID",
-        "QT_QPA_PLATFORM",
-
-        "DISPLAY",
-        "DE",
-        "DESKTOP_SESSION",
-        "WAYLAND_DISPLAY",
-        "XAUTHORITY",
-        "WINDOWID",
-        "WINDOWPATH",
-        "I3SOCK",
-
-        "LS_COLORS",
-        "GREP_COLORS",
-        "LESS",
-        "LESSOPEN",
-        "LESSCLOSE",
-
-        NULL,
-    };
+    if (jobs_arg != NULL) {
+        cf_max_jobs = cf_parse_jobs(jobs_arg, "-j");
+    } else if (getenv("CF_JOBS") != NULL) {
+        cf_max_jobs = cf_parse_jobs(getenv("CF_JOBS"), "CF_JOBS");
+    } else {
+        cf_max_jobs = cf_detect_jobs();
+    }
+
+    if (timeout_arg != NULL) {
+        cf_job_timeout_s = cf_parse_timeout(timeout_arg, "--timeout");
+    } else if (getenv("CF_TIMEOUT") != NULL) {
+        cf_job_timeout_s = cf_parse_timeout(getenv("CF_TIMEOUT"), "CF_TIMEOUT");
+    }
 
-    for (size_t i = 0; cf_automask_env[i] != NULL; i++) {
-        unsetenv(cf_automask_env[i]);
+    if (remote_arg != NULL && remote_arg[0] != '\0') {
+        cf_remote_setup(remote_arg);
     }
-#endif // CF_DISABLE_ENV_AUTOMASK
-    denv_hash = cf_hash_env(environ);
+
+    cf_jobserver_setup(cf_max_jobs);
+    /* Registered before cf_flush_on_exit(), so it runs after the commands were reaped */
+    atexit(cf_jobserver_return_held);
 
     global_workq = (cf_work_queue*) malloc(sizeof(cf_work_queue));
     if (global_workq == NULL) {
@@ -1839,65 +7433,125 @@ __attribute__((weak)) int main(int argc, char** argv) {
     }
     global_workq->front = 0;
     global_workq->back = 0;
+    global_workq->ready_head = NULL;
+    global_workq->ready_tail = NULL;
     global_workq->active_jobs = 0;
+    global_workq->shutdown = false;
+    global_workq->failed = false;
+    global_workq->signal = 0;
+    global_workq->running_jobs = 0;
     mtx_init(&global_workq->lock, mtx_plain);
     cnd_init(&global_workq->free_slot);
     cnd_init(&global_workq->new_job);
     cnd_init(&global_workq->no_job);
+    cnd_init(&global_workq->target_done);
+    cnd_init(&global_workq->prefetched);
+
+    /* Blocked before the first worker starts, so every thread inherits it */
+    static sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+    /* Started before the signal thread, which may cancel commands and save the DB right away */
+    mtx_init(&cf_db_save_lock, mtx_plain);
+    mtx_init(&cf_child_lock, mtx_plain);
+    cnd_init(&cf_child_changed);
+    thrd_t watchdog_thread;
+    if (thrd_create(&watchdog_thread, &cf_watchdog_thrd, NULL) != thrd_success) {
+        CF_ERR_LOG("Error: Thread failed during creation in main()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+    thrd_detach(watchdog_thread);
+    cf_children_ready = true;
+
+    thrd_t signal_thread;
+    if (thrd_create(&signal_thread, &cf_signal_thrd, (void*) &stop_signals) != thrd_success) {
+        CF_ERR_LOG("Error: Thread failed during creation in main()\n");
+        exit(CF_CLIB_FAIL_EC);
+    }
+    thrd_detach(signal_thread);
+
+    cf_main_thrd = thrd_current();
+    atexit(cf_flush_on_exit);
 
+    /* Planning every root up front lets config variants given together build concurrently */
     cf_state = TARGET_EXECUTE_PHASE;
-    for (int32_t i = 1; i < argc; i++) {
-        for (size_t j = 0; j < cf_num_targets; j++) {
-            cf_target_decl_t* target = &cf_targets[j];
-            if (strcmp(target->name, argv[i]) == 0) {
-                if (target->node_status == DONE) {
-                    CF_WRN_LOG("Warning: Target \"%s\" was executed already! Skipping target...\n", argv[i]);
-                    goto next_iter;
-                }
-                cf_dfs_execute(target, NULL);
-                goto next_iter;
-            }
+    cf_build_running = true;
+    static cf_target_decl_t* order[CF_MAX_TARGETS];
+    size_t order_size = 0;
+    size_t phase = 0;
+    cf_target_decl_t* prev_root = NULL;
+    for (int32_t i = 1; i <= num_target_args; i++) {
+        size_t idx = cf_find_target_index(argv[i]);
+        if (idx >= cf_num_targets) {
+            CF_ERR_LOG("Error: Target \"%s\" not found!\n", argv[i]);
+            return CF_NOT_FOUND_EC;
         }
 
-        CF_ERR_LOG("Error: Target \"%s\" not found!\n", argv[i]);
-        return CF_NOT_FOUND_EC;
-
-        next_iter:
+        cf_target_decl_t* target = cf_target_instance(&cf_targets[idx], NULL);
+        if (target->node_status != UNVISITED) {
+            CF_WRN_LOG("Warning: Target \"%s\" was executed already! Skipping target...\n", argv[i]);
             continue;
-    }
+        }
 
-    cf_db_save(".cforge.db", global_db);
+        if (prev_root != NULL && !cf_root_joins_phase(prev_root, target)) {
+            phase++;
+        }
 
-    mtx_lock(&global_workq->lock);
-    while (cf_full_job()) {
-        cnd_wait(&global_workq->no_job, &global_workq->lock);
+        size_t planned = order_size;
+        cf_dfs_plan(target, order, &order_size);
+        for (size_t j = planned; j < order_size; j++) {
+            order[j]->phase = phase;
+        }
+        prev_root = target;
     }
-    for (size_t t = 0; t < cf_num_thrds; t++) {
+    cf_dfs_execute(order, order_size);
+    cf_build_running = false;
+    cf_report_failures(order, order_size);
+    cf_db_save_global();
 
-        cf_enqueue_job((cf_thrd_job) {
-            .command = NULL
-        });
-        cnd_signal(&global_workq->new_job);
-    }
+    /* Workers exit once the queue is drained */
+    mtx_lock(&global_workq->lock);
+    global_workq->shutdown = true;
+    cnd_broadcast(&global_workq->new_job);
     mtx_unlock(&global_workq->lock);
 
     for (size_t t = cf_num_thrds; t > 0; t--) {
         thrd_join(cf_thrd_pool[t - 1], NULL);
         cf_thrd_pool[t - 1] = (thrd_t) { 0 };
     }
+    free(cf_thrd_pool);
+
+    /* The watchdog stays parked on the lock, only its table goes */
+    mtx_lock(&cf_child_lock);
+    free(cf_children);
+    cf_children = NULL;
+    cf_children_cap = 0;
+    mtx_unlock(&cf_child_lock);
+    cf_env_invalidate();
+    cf_cache_trim();
+    cf_remote_teardown();
+    cf_free_job_nodes(cf_unowned_jobs);
 
     mtx_destroy(&global_workq->lock);
     cnd_destroy(&global_workq->free_slot);
     cnd_destroy(&global_workq->new_job);
     cnd_destroy(&global_workq->no_job);
+    cnd_destroy(&global_workq->target_done);
+    cnd_destroy(&global_workq->prefetched);
     free(global_workq);
 
 cleanup:
     for (size_t t_idx = 0; t_idx < cf_num_targets; t_idx++) {
-        free(cf_targets[t_idx].attribs);
+        if (cf_targets[t_idx].base == NULL) {
+            free(cf_targets[t_idx].attribs);
+        }
+        free(cf_targets[t_idx].deps);
     }
 
-    return CF_SUCCESS_EC;
+    return (cf_num_failures > 0) ? CF_CLIB_FAIL_EC : CF_SUCCESS_EC;
 }
 
 
@@ -1972,28 +7626,60 @@ static inline cf_glob_iter_hack_t cf_glob_begin_hack(const char *expr) {
 #define CF_RUN(...) CF__CAT(CF_RUN_,  CF__HAS_ARGS(__VA_ARGS__))(__VA_ARGS__)
 #define CF_RUNP(...) CF__CAT(CF_RUNP_, CF__HAS_ARGS(__VA_ARGS__))(__VA_ARGS__)
 
-#define CF_RUN_1(fmt) CF_INTERNAL_RUNNER(false, "%s", fmt)
-#define CF_RUN_M(fmt, ...) CF_INTERNAL_RUNNER(false, fmt, __VA_ARGS__)
-#define CF_RUNP_1(fmt) CF_INTERNAL_RUNNER(true,  "%s", fmt)
-#define CF_RUNP_M(fmt, ...) CF_INTERNAL_RUNNER(true,  fmt, __VA_ARGS__)
+#define CF_RUN_1(fmt) cf_internal_runner(false, NULL, 0, "%s", fmt)
+#define CF_RUN_M(fmt, ...) cf_internal_runner(false, NULL, 0, fmt, __VA_ARGS__)
+#define CF_RUNP_1(fmt) cf_internal_runner(true, NULL, 0, "%s", fmt)
+#define CF_RUNP_M(fmt, ...) cf_internal_runner(true, NULL, 0, fmt, __VA_ARGS__)
 
-#define CF_INTERNAL_RUNNER(parallel, format_str, ...) \
-    do { \
-        char* buffer = malloc(CF_MAX_COMMAND_LENGTH); \
-        if (buffer == NULL) { \
-            CF_ERR_LOG("Error: malloc() failed in CF_INTERNAL_RUNNER\n"); \
-            exit(CF_CLIB_FAIL_EC); \
-        } \
-        int n = snprintf(buffer, CF_MAX_COMMAND_LENGTH, format_str, __VA_ARGS__); \
-        if (n < 0) { \
-            CF_ERR_LOG("Error: snprintf() failed in CF_INTERNAL_RUNNER\n"); \
-            exit(CF_CLIB_FAIL_EC); \
-        }else if (n >= CF_MAX_COMMAND_LENGTH) { \
-            CF_ERR_LOG("Error: Maximum command length of %d was reached!\n", CF_MAX_COMMAND_LENGTH); \
-            exit(CF_MAX_REACHED_EC); \
-        } \
-        cf_execute_command(parallel, buffer); \
-    } while (0)
+/* `jobs` is a parenthesized list of job handles, e.g. `(obj_a, obj_b)` */
+#define CF_RUNP_AFTER(jobs, ...) CF__CAT(CF_RUNP_AFTER_, CF__HAS_ARGS(__VA_ARGS__))(jobs, __VA_ARGS__)
+
+#define CF_RUNP_AFTER_1(jobs, fmt) cf_internal_runner(true, CF__JOB_LIST jobs, CF__JOB_COUNT jobs, "%s", fmt)
+#define CF_RUNP_AFTER_M(jobs, fmt, ...) cf_internal_runner(true, CF__JOB_LIST jobs, CF__JOB_COUNT jobs, fmt, __VA_ARGS__)
+
+#define CF__JOB_LIST(...) ((cf_job_t[]) { __VA_ARGS__ })
+#define CF__JOB_COUNT(...) (sizeof((cf_job_t[]) { __VA_ARGS__ }) / sizeof(cf_job_t))
+
+#define CF_NO_JOB ((cf_job_t) NULL)
+
+/* `inputs` and `outputs` are non-empty parenthesized lists of paths */
+#define CF_RUN_CACHED(inputs, outputs, ...) CF__CAT(CF_RUN_CACHED_, CF__HAS_ARGS(__VA_ARGS__))(false, inputs, outputs, __VA_ARGS__)
+#define CF_RUNP_CACHED(inputs, outputs, ...) CF__CAT(CF_RUN_CACHED_, CF__HAS_ARGS(__VA_ARGS__))(true, inputs, outputs, __VA_ARGS__)
+
+#define CF_RUN_CACHED_1(parallel, inputs, outputs, fmt) \
+    cf_cached_runner(parallel, CF__PATH_LIST inputs, CF__PATH_COUNT inputs, CF__PATH_LIST outputs, CF__PATH_COUNT outputs, "%s", fmt)
+#define CF_RUN_CACHED_M(parallel, inputs, outputs, fmt, ...) \
+    cf_cached_runner(parallel, CF__PATH_LIST inputs, CF__PATH_COUNT inputs, CF__PATH_LIST outputs, CF__PATH_COUNT outputs, fmt, __VA_ARGS__)
+
+/* Skipped unless the command line, an input or an output changed since the last run */
+#define CF_RUN_TRACKED(inputs, outputs, ...) CF__CAT(CF_RUN_TRACKED_, CF__HAS_ARGS(__VA_ARGS__))(false, inputs, outputs, __VA_ARGS__)
+#define CF_RUNP_TRACKED(inputs, outputs, ...) CF__CAT(CF_RUN_TRACKED_, CF__HAS_ARGS(__VA_ARGS__))(true, inputs, outputs, __VA_ARGS__)
+
+#define CF_RUN_TRACKED_1(parallel, inputs, outputs, fmt) \
+    cf_tracked_runner(parallel, CF__PATH_LIST inputs, CF__PATH_COUNT inputs, CF__PATH_LIST outputs, CF__PATH_COUNT outputs, "%s", fmt)
+#define CF_RUN_TRACKED_M(parallel, inputs, outputs, fmt, ...) \
+    cf_tracked_runner(parallel, CF__PATH_LIST inputs, CF__PATH_COUNT inputs, CF__PATH_LIST outputs, CF__PATH_COUNT outputs, fmt, __VA_ARGS__)
+
+#define CF__PATH_LIST(...) ((const char*[]) { __VA_ARGS__ })
+#define CF__PATH_COUNT(...) (sizeof((const char*[]) { __VA_ARGS__ }) / sizeof(const char*))
+
+#define CF_GROUP(name) \
+    cf_group_t* name = cf_group_new()
+
+#define CF_RUNP_IN(group, ...) \
+    cf_group_add(group, CF_RUNP(__VA_ARGS__))
+
+#define CF_RUNP_AFTER_IN(group, jobs, ...) \
+    cf_group_add(group, CF_RUNP_AFTER(jobs, __VA_ARGS__))
+
+#define CF_GROUP_ADD(group, job) \
+    cf_group_add(group, job)
+
+#define CF_WAIT(group) \
+    cf_wait_group(group)
+
+#define CF_WAIT_ALL() \
+    cf_wait_all()
 
 #define CF_DEPENDS(target_ident) \
     (cf_attr_t) { \
@@ -2035,7 +7721,7 @@ static inline cf_glob_iter_hack_t cf_glob_begin_hack(const char *expr) {
 #define CF_APPEND_ENV(ident, value) cf_joinenv_wrapper(true, #ident, value)
 #define CF_PREPEND_ENV(ident, value) cf_joinenv_wrapper(false, #ident, value)
 #define CF_MASK_ENV(ident) cf_setenv_wrapper(#ident, "")
-#define CF_ENV(ident) getenv(#ident)
+#define CF_ENV(ident) cf_getenv_wrapper(#ident)
 
 #define CF_MAPA(sources, len, ...) \
     cf_map(sources, len, (cf_map_attr_t[]) { __VA_ARGS__ }, (sizeof((cf_map_attr_t[]) { __VA_ARGS__ })/sizeof(cf_map_attr_t)))
@@ -2076,11 +7762,35 @@ static inline cf_glob_iter_hack_t cf_glob_begin_hack(const char *expr) {
 #define CF_FILE_NOT_UTD(filepath) \
     (!cf_file_utd((char*) filepath))
 
+#define CF_FILES_UTD(paths, len) \
+    cf_files_utd((char**) paths, len)
+
+#define CF_FILES_STALE(paths, len) \
+    cf_files_stale((char**) paths, len)
+
+#define CF_GLOB_STALE(glob) \
+    cf_glob_stale(glob)
+
 #define CF_FILE_MARK_UTD(filepath) \
-    cf_db_mark_utd(filepath, global_db)
+    cf_db_mark_utd(filepath, cf_db_get())
 
 #define CF_FILE_MARK_UTDP(filepath) \
-    cf_db_defer_mark_utd((char*) filepath)
+    cf_db_defer_mark_utd((char*) filepath, NULL)
+
+#define CF_FILE_MARK_DEPS(filepath, depfile) \
+    cf_db_defer_mark_deps((char*) filepath, depfile, NULL)
+
+#define CF_FILE_MARK_SCAN(filepath, includes) \
+    cf_db_defer_mark_scan((char*) filepath, includes, NULL)
+
+#define CF_FILE_MARK_UTDP_AFTER(job, filepath) \
+    cf_db_defer_mark_utd((char*) filepath, (cf_job_t[]) { job })
+
+#define CF_FILE_MARK_DEPS_AFTER(job, filepath, depfile) \
+    cf_db_defer_mark_deps((char*) filepath, depfile, (cf_job_t[]) { job })
+
+#define CF_FILE_MARK_SCAN_AFTER(job, filepath, includes) \
+    cf_db_defer_mark_scan((char*) filepath, includes, (cf_job_t[]) { job })
 
 #define CF_FILE_EXISTS(filepath) \
     (cf_file_exists((char*) filepath))
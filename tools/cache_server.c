@@ -0,0 +1,329 @@
+/*
+ * Reference remote cache server for cforge.h
+ *
+ * Serves GET, HEAD and PUT of cache objects below a directory over HTTP/1.1
+ * with keep-alive and pipelining. It is meant for local testing and small
+ * trusted networks: there is no authentication and no eviction.
+ *
+ * Build: cc -O2 -o cache_server tools/cache_server.c
+ * Usage: ./cache_server [-p PORT] [-a ADDRESS] [DIR]
+ *        ./cforge.h --remote-cache=http://127.0.0.1:PORT <target>
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define CS_BUF_SZ (64 * 1024)
+#define CS_LINE_SZ 2048
+#define CS_IDLE_TIMEOUT_S 60
+
+typedef struct {
+    int32_t fd;
+    size_t pos;
+    size_t len;
+    char buf[CS_BUF_SZ];
+} cs_conn_t;
+
+static bool cs_fill(cs_conn_t* conn) {
+    ssize_t n;
+    do {
+        n = recv(conn->fd, conn->buf, sizeof(conn->buf), 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        return false;
+    }
+    conn->pos = 0;
+    conn->len = (size_t) n;
+
+    return true;
+}
+
+static bool cs_read_line(cs_conn_t* conn, char* line, size_t size) {
+    size_t len = 0;
+    for (;;) {
+        if (conn->pos == conn->len && !cs_fill(conn)) {
+            return false;
+        }
+
+        char c = conn->buf[conn->pos++];
+        if (c == '\n') {
+            break;
+        }
+
+        if (len + 1 >= size) {
+            return false;
+        }
+        line[len++] = c;
+    }
+
+    if (len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
+    line[len] = '\0';
+
+    return true;
+}
+
+static bool cs_send(int32_t fd, const void* data, size_t len) {
+    const char* p = (const char*) data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= (size_t) n;
+    }
+
+    return true;
+}
+
+static bool cs_respond(int32_t fd, int32_t status, const char* reason, uint64_t length) {
+    char head[256];
+    int32_t len = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nContent-Length: %llu\r\n\r\n", status, reason, (unsigned long long) length);
+    return cs_send(fd, head, (size_t) len);
+}
+
+/* Only plain relative paths, so requests can't escape the served directory */
+static bool cs_valid_path(const char* path) {
+    if (path[0] != '/' || path[1] == '\0' || strstr(path, "..") != NULL || strstr(path, "//") != NULL) {
+        return false;
+    }
+
+    return strspn(path + 1, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-/") == strlen(path + 1);
+}
+
+static void cs_make_parents(char* path) {
+    for (char* slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
+    }
+}
+
+/* Streams a body of length bytes into out, or drops it if out is -1 */
+static bool cs_read_body(cs_conn_t* conn, uint64_t length, int32_t out, bool* stored) {
+    while (length > 0) {
+        if (conn->pos == conn->len && !cs_fill(conn)) {
+            return false;
+        }
+
+        size_t n = conn->len - conn->pos;
+        if (n > length) {
+            n = (size_t) length;
+        }
+
+        if (out >= 0 && *stored && write(out, conn->buf + conn->pos, n) != (ssize_t) n) {
+            *stored = false;
+        }
+        conn->pos += n;
+        length -= n;
+    }
+
+    return true;
+}
+
+static bool cs_get(int32_t fd, const char* path, bool head) {
+    int32_t in = open(path, O_RDONLY);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (in >= 0) {
+            close(in);
+        }
+        return cs_respond(fd, 404, "Not Found", 0);
+    }
+
+    bool ok = cs_respond(fd, 200, "OK", (uint64_t) st.st_size);
+    uint64_t left = head ? 0 : (uint64_t) st.st_size;
+    char buf[CS_BUF_SZ];
+    while (ok && left > 0) {
+        ssize_t n = read(in, buf, sizeof(buf) < left ? sizeof(buf) : (size_t) left);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        ok = n > 0 && cs_send(fd, buf, (size_t) n);
+        left -= (n > 0) ? (uint64_t) n : 0;
+    }
+    close(in);
+
+    return ok;
+}
+
+/* Objects are written to a temporary file first so readers never see partial ones */
+static bool cs_put(cs_conn_t* conn, char* path, uint64_t length) {
+    char tmp[CS_LINE_SZ + 32];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%ld", path, (long) getpid());
+    cs_make_parents(path);
+
+    int32_t out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool stored = (out >= 0);
+    if (!cs_read_body(conn, length, out, &stored)) {
+        if (out >= 0) {
+            close(out);
+            unlink(tmp);
+        }
+        return false;
+    }
+
+    if (out >= 0) {
+        stored = close(out) == 0 && stored && rename(tmp, path) == 0;
+        if (!stored) {
+            unlink(tmp);
+        }
+    }
+
+    if (!stored) {
+        return cs_respond(conn->fd, 500, "Internal Server Error", 0);
+    }
+
+    return cs_respond(conn->fd, 201, "Created", 0);
+}
+
+/* Requests are answered strictly in order, which is all pipelining needs */
+static void cs_serve(int32_t fd) {
+    cs_conn_t* conn = (cs_conn_t*) malloc(sizeof(cs_conn_t));
+    if (conn == NULL) {
+        return;
+    }
+    conn->fd = fd;
+    conn->pos = 0;
+    conn->len = 0;
+
+    char line[CS_LINE_SZ];
+    for (;;) {
+        char method[16];
+        char target[CS_LINE_SZ];
+        if (!cs_read_line(conn, line, sizeof(line)) || sscanf(line, "%15s %2047s HTTP/1.%*d", method, target) != 2) {
+            break;
+        }
+
+        uint64_t length = 0;
+        bool keep = true;
+        bool head_ok = true;
+        while ((head_ok = cs_read_line(conn, line, sizeof(line))) && line[0] != '\0') {
+            if (strncasecmp(line, "Content-Length:", 15) == 0) {
+                length = strtoull(line + 15, NULL, 10);
+            } else if (strncasecmp(line, "Connection:", 11) == 0 && strstr(line + 11, "close") != NULL) {
+                keep = false;
+            }
+        }
+
+        if (!head_ok) {
+            break;
+        }
+
+        char path[CS_LINE_SZ];
+        bool valid = cs_valid_path(target);
+        snprintf(path, sizeof(path), "%s", target + 1);
+
+        bool ok;
+        if (strcmp(method, "PUT") == 0) {
+            bool unused = false;
+            ok = valid ? cs_put(conn, path, length) : cs_read_body(conn, length, -1, &unused) && cs_respond(fd, 400, "Bad Request", 0);
+        } else if (strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0) {
+            ok = valid ? cs_get(fd, path, method[0] == 'H') : cs_respond(fd, 400, "Bad Request", 0);
+        } else {
+            ok = cs_respond(fd, 405, "Method Not Allowed", 0);
+            keep = false;
+        }
+
+        if (!ok || !keep) {
+            break;
+        }
+    }
+
+    free(conn);
+}
+
+int main(int argc, char** argv) {
+    const char* address = "127.0.0.1";
+    const char* dir = ".cforge-remote";
+    long port = 8080;
+    for (int32_t i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            port = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            address = argv[++i];
+        } else if (argv[i][0] != '-') {
+            dir = argv[i];
+        } else {
+            fprintf(stderr, "Usage: %s [-p PORT] [-a ADDRESS] [DIR]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (port <= 0 || port > 65535) {
+        fprintf(stderr, "Error: Invalid port!\n");
+        return 1;
+    }
+
+    mkdir(dir, 0755);
+    if (chdir(dir) != 0) {
+        fprintf(stderr, "Error: Could not enter \"%s\"!\n", dir);
+        return 1;
+    }
+
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t) port);
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Error: Invalid IPv4 address \"%s\"!\n", address);
+        return 1;
+    }
+
+    int32_t one = 1;
+    int32_t listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("socket");
+        return 1;
+    }
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listener, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(listener, 128) != 0) {
+        perror("bind");
+        return 1;
+    }
+
+    /* One process per connection, reaped by the kernel */
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    printf("Serving \"%s\" on http://%s:%ld\n", dir, address, port);
+    fflush(stdout);
+
+    for (;;) {
+        int32_t fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            struct timeval timeout = { .tv_sec = CS_IDLE_TIMEOUT_S, .tv_usec = 0 };
+            close(listener);
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            cs_serve(fd);
+            close(fd);
+            _exit(0);
+        }
+        close(fd);
+    }
+}
@@ -0,0 +1,46 @@
+#!/bin/sh
+
+# Shell builtins and reserved words given to CF_RUN() must still go
+# through sh, the same as with system(). Run from the repository root.
+
+HEADER_FILE="$(pwd)/cforge.h"
+TMP_DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+cp "$HEADER_FILE" "$TMP_DIR/cforge.h"
+cat > "$TMP_DIR/cforge.c" <<'SRC'
+#include "cforge.h"
+
+CF_TARGET(builtins, CF_HELP_STRING("Run shell builtins")) {
+    CF_RUN(": x");
+    CF_RUN("true");
+    CF_RUN("cd /tmp");
+    CF_RUN("export A=1");
+    CF_RUN("umask 022");
+    CF_RUN("set -e");
+    CF_RUN(". ./empty.sh");
+    CF_RUN("exit 0");
+}
+
+CF_TARGET(missing, CF_HELP_STRING("Run a program that does not exist")) {
+    CF_RUN("cf-no-such-program x");
+}
+SRC
+: > "$TMP_DIR/empty.sh"
+
+cd "$TMP_DIR" || exit 1
+
+./cforge.h builtins || {
+    printf "Builtins check failed\n"
+    exit 1
+}
+
+OUT="$(./cforge.h missing 2>&1)"
+RC=$?
+if [ "$RC" -ne 4 ] || ! printf "%s\n" "$OUT" | grep -q "exit status 127"; then
+    printf "%s\n" "$OUT"
+    printf "Missing program check failed (exit status %d)\n" "$RC"
+    exit 1
+fi
+
+printf "Builtins OK\n"